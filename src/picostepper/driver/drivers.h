@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+
+#ifndef PICOSTEPPER_DRIVERS_H
+#define PICOSTEPPER_DRIVERS_H
+
+// Polarity of the direction signal
+#define A4988 false
+#define TMC2208 true
+
+// Table of the supported drivers, expanded by X(...) into the driver types and their descriptors
+// X(type, PIO-program, PIO-program with DIR and PUL swapped, pins, direction polarity, min. pulse width (ns), min. DIR setup time (ns))
+// A new driver is added with a line here and its PIO-program in this folder
+#define PICOSTEPPER_DRIVERS(X) \
+  X(FourWireDriver, picostepper_four_wire, picostepper_four_wire, 4, A4988, 1000, 2000) \
+  X(TwoWireDriver, picostepper_two_wire, picostepper_two_wire_reversed, 2, A4988, 1000, 200) \
+  X(TwoWireTMC2208, picostepper_two_wire, picostepper_two_wire_reversed, 2, TMC2208, 100, 20)
+
+// Timing of the driver programs: PUL is low (and DIR set up) for delay + 2 cycles, then high for 8 cycles
+#define PICOSTEPPER_CYCLE_NS (8 * CLKDIV) // Duration of a PIO cycle at a system clock of 125MHz
+#define PICOSTEPPER_LOW_CYCLES 2
+#define PICOSTEPPER_HIGH_CYCLES 8
+#define PICOSTEPPER_CYCLES(ns) (((ns) + PICOSTEPPER_CYCLE_NS - 1) / PICOSTEPPER_CYCLE_NS)
+
+// Smallest delay that keeps PUL low for the pulse width and DIR stable for the setup time before PUL rises
+#define PICOSTEPPER_MIN_DELAY(pulse_width, dir_setup) \
+  (PICOSTEPPER_CYCLES((pulse_width) > (dir_setup) ? (pulse_width) : (dir_setup)) > PICOSTEPPER_LOW_CYCLES ? \
+   PICOSTEPPER_CYCLES((pulse_width) > (dir_setup) ? (pulse_width) : (dir_setup)) - PICOSTEPPER_LOW_CYCLES : 0)
+
+#endif
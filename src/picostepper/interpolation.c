@@ -0,0 +1,380 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+
+#include "interpolation.h"
+
+_Static_assert(INTERPOLATION_LOOKAHEAD >= 2, "The paths following the running one have to be known to plan its exit");
+
+// Set up the interpolation of paths on a machine
+void picostepper_interpolation_init(PicoStepperInterpolation *interpolation, PicoStepperKinematics *kinematics) {
+  interpolation->kinematics = kinematics;
+  interpolation->tolerance = INTERPOLATION_TOLERANCE;
+  interpolation->segment_length = INTERPOLATION_SEGMENT_LENGTH;
+  interpolation->acceleration = 0;
+  interpolation->junction_deviation = INTERPOLATION_JUNCTION_DEVIATION;
+  interpolation->queue_head = 0;
+  interpolation->queue_count = 0;
+  interpolation->feed_rate = 0;
+}
+
+// Set the maximum deviation (mm) of the chords of an arc from the arc
+void picostepper_interpolation_set_tolerance(PicoStepperInterpolation *interpolation, float tolerance) {
+  interpolation->tolerance = max((uint) ((double) tolerance * 1000.0 + 0.5), 1);
+}
+
+// Set the length (mm) of the segments while accelerating and decelerating
+void picostepper_interpolation_set_segment_length(PicoStepperInterpolation *interpolation, float length) {
+  interpolation->segment_length = max((uint) ((double) length * 1000.0 + 0.5), 1);
+}
+
+// Set the acceleration (mm/s^2) along the path at the start and the end of a movement and at sharp junctions
+void picostepper_interpolation_set_acceleration(PicoStepperInterpolation *interpolation, float acceleration) {
+  interpolation->acceleration = (uint) ((double) acceleration * 1000.0 + 0.5);
+}
+
+// Set the distance (mm) the corner between two paths may be rounded off by, which limits the feed rate at the corner
+void picostepper_interpolation_set_junction_deviation(PicoStepperInterpolation *interpolation, float deviation) {
+  interpolation->junction_deviation = (uint) ((double) deviation * 1000.0 + 0.5);
+}
+
+// Get the point at distance um along a path
+static PicoStepperPoint picostepper_path_point(const PicoStepperPath *path, uint distance) {
+  // The last point is the exact target, so no rounding errors accumulate over multiple paths
+  if(distance >= path->length) {
+    return path->target;
+  }
+
+  PicoStepperPoint point;
+  int64_t dz = (int64_t) path->target.z - path->start.z;
+  point.z = path->start.z + (int32_t) ((dz * distance) / path->length);
+
+  if(path->is_arc) {
+    double angle = path->start_angle + path->sweep * (double) distance / (double) path->length;
+    point.x = (int32_t) lround(path->center_x + path->radius * cos(angle));
+    point.y = (int32_t) lround(path->center_y + path->radius * sin(angle));
+  } else {
+    int64_t dx = (int64_t) path->target.x - path->start.x;
+    int64_t dy = (int64_t) path->target.y - path->start.y;
+    point.x = path->start.x + (int32_t) ((dx * distance) / path->length);
+    point.y = path->start.y + (int32_t) ((dy * distance) / path->length);
+  }
+  return point;
+}
+
+// Get the feed rate reached from feed_rate over distance um under the acceleration: v^2 = v0^2 + 2*a*s
+static uint64_t picostepper_reachable_feed_rate(const PicoStepperInterpolation *interpolation, uint feed_rate, uint64_t distance) {
+  if(interpolation->acceleration == 0) {
+    return UINT32_MAX;
+  }
+  return picostepper_kinematics_sqrt((uint64_t) feed_rate * feed_rate + 2 * (uint64_t) interpolation->acceleration * distance);
+}
+
+// Get the feed rate at distance um along a path, accelerating from the entry and decelerating to the exit feed rate at end um
+static uint picostepper_path_feed_rate(const PicoStepperInterpolation *interpolation, const PicoStepperPath *path, uint distance, uint end, uint entry_feed_rate, uint exit_feed_rate) {
+  uint64_t feed_rate = path->feed_rate;
+  feed_rate = min(feed_rate, picostepper_reachable_feed_rate(interpolation, entry_feed_rate, distance));
+  feed_rate = min(feed_rate, picostepper_reachable_feed_rate(interpolation, exit_feed_rate, end - min(distance, end)));
+  return max((uint) feed_rate, 1);
+}
+
+// Get the highest feed rate (um/s) to pass from one path into the next, for which the corner between the directions
+// can be rounded off within the junction deviation under the acceleration: v^2 = a * deviation * sin(angle/2) / (1 - sin(angle/2))
+static uint picostepper_junction_feed_rate(const PicoStepperInterpolation *interpolation, const double from[3], const double to[3]) {
+  if(interpolation->acceleration == 0) {
+    return UINT32_MAX;
+  }
+  double cos_angle = -(from[0] * to[0] + from[1] * to[1] + from[2] * to[2]);
+  // Reversing, the machine has to stop
+  if(cos_angle > 0.999999) {
+    return 0;
+  }
+  // Continuing straight on
+  if(cos_angle < -0.999999) {
+    return UINT32_MAX;
+  }
+  double sin_half_angle = sqrt(0.5 * (1.0 - cos_angle));
+  double squared = (double) interpolation->acceleration * interpolation->junction_deviation * sin_half_angle / (1.0 - sin_half_angle);
+  return (uint) min(sqrt(squared), (double) UINT32_MAX);
+}
+
+// Split a path into segments, transform them in batches and stream them to the steppers
+// Enters the path at entry_feed_rate and leaves it at exit_feed_rate (um/s), without waiting for the last segment
+static bool picostepper_interpolation_run(PicoStepperInterpolation *interpolation, const PicoStepperPath *path, uint entry_feed_rate, uint exit_feed_rate) {
+  PicoStepperKinematics *kinematics = interpolation->kinematics;
+
+  // The shaped velocities of the steppers lag behind the commanded ones. At the end of a movement a last segment
+  // keeps the feed rate of the last decelerating one, the steppers stream it in short parts until they have settled.
+  uint end = path->length;
+  uint tail_length = 0;
+  if(exit_feed_rate == 0 && interpolation->acceleration > 0) {
+    uint duration = 0;
+    for (size_t axis = 0; axis < kinematics->axes; axis++)
+    {
+      duration = max(duration, picostepper_get_shaper_duration(kinematics->devices[axis]));
+    }
+    uint tail_feed_rate = min(picostepper_kinematics_sqrt((uint64_t) interpolation->acceleration * interpolation->segment_length), path->feed_rate);
+    uint64_t squared_entry = (uint64_t) min(entry_feed_rate, path->feed_rate) * min(entry_feed_rate, path->feed_rate);
+    uint64_t squared_tail = (uint64_t) tail_feed_rate * tail_feed_rate;
+    uint64_t ramp_length = squared_entry > squared_tail ? (squared_entry - squared_tail) / (2 * (uint64_t) interpolation->acceleration) : 0;
+    // While settling the shaped feed rate stays below the one the profile had twice the duration before the end
+    uint64_t tail_bound = tail_feed_rate + ((uint64_t) interpolation->acceleration * 2 * duration) / 1000000;
+    uint64_t tail_segment_length = (tail_bound * duration + 999999) / 1000000;
+    // Paths too short to decelerate to the tail feed rate before it stop without the tail
+    if(duration > 0 && ramp_length + tail_segment_length <= path->length) {
+      tail_length = (uint) tail_segment_length;
+      end = path->length - tail_length;
+      exit_feed_rate = tail_feed_rate;
+    }
+  }
+
+  // Segments are only shortened while the feed rate changes
+  uint accelerate_length = 0;
+  uint decelerate_length = 0;
+  if(interpolation->acceleration > 0) {
+    uint64_t squared_feed_rate = (uint64_t) path->feed_rate * path->feed_rate;
+    uint64_t squared_entry = (uint64_t) min(entry_feed_rate, path->feed_rate) * min(entry_feed_rate, path->feed_rate);
+    uint64_t squared_exit = (uint64_t) min(exit_feed_rate, path->feed_rate) * min(exit_feed_rate, path->feed_rate);
+    accelerate_length = (uint) min((squared_feed_rate - squared_entry) / (2 * (uint64_t) interpolation->acceleration), (uint64_t) path->length);
+    decelerate_length = (uint) min((squared_feed_rate - squared_exit) / (2 * (uint64_t) interpolation->acceleration) + tail_length, (uint64_t) path->length);
+  }
+
+  PicoStepperPoint points[KINEMATICS_BATCH];
+  int steps[KINEMATICS_BATCH][KINEMATICS_MAX_AXES];
+  uint lengths[KINEMATICS_BATCH];
+  uint feed_rates[KINEMATICS_BATCH];
+  uint speeds[KINEMATICS_MAX_AXES];
+  uint distance = 0;
+
+  while (distance < path->length)
+  {
+    // Generate the next batch of segments
+    uint count = 0;
+    while (count < KINEMATICS_BATCH && distance < path->length)
+    {
+      uint length = path->chord_length;
+      uint remaining = path->length - distance;
+      if(remaining > tail_length && (distance < accelerate_length || remaining <= decelerate_length)) {
+        length = min(length, interpolation->segment_length);
+        length = min(length, remaining - tail_length);
+      } else if(remaining > decelerate_length) {
+        length = min(length, remaining - decelerate_length);
+      }
+      if(kinematics->type == DeltaKinematics) {
+        length = min(length, kinematics->segment_length);
+      }
+      length = max(min(length, remaining), 1);
+
+      feed_rates[count] = picostepper_path_feed_rate(interpolation, path, distance + length / 2, end, entry_feed_rate, exit_feed_rate);
+      lengths[count] = length;
+      distance += length;
+      points[count] = picostepper_path_point(path, distance);
+      count++;
+    }
+
+    // Error: The path leaves the reachable space
+    if(!picostepper_kinematics_transform(kinematics, points, steps, count)) {
+      return false;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+      picostepper_kinematics_speeds(kinematics, steps[i], lengths[i], feed_rates[i], speeds);
+      picostepper_stream_segment(kinematics->devices, steps[i], speeds, kinematics->axes);
+      kinematics->position = points[i];
+    }
+  }
+  return true;
+}
+
+// Plan the feed rates at the junctions of the queued paths backwards from the last one, which has to stop at its end
+static void picostepper_interpolation_plan(PicoStepperInterpolation *interpolation) {
+  uint exit_feed_rate = 0;
+  for (int i = (int) interpolation->queue_count - 1; i >= 0; i--)
+  {
+    PicoStepperPath *path = &interpolation->queue[(interpolation->queue_head + i) % INTERPOLATION_LOOKAHEAD];
+    uint64_t reachable = picostepper_reachable_feed_rate(interpolation, exit_feed_rate, path->length);
+    path->entry_feed_rate = (uint) min((uint64_t) path->max_entry_feed_rate, reachable);
+    exit_feed_rate = path->entry_feed_rate;
+  }
+}
+
+// Run the oldest queued path, leaving it at the planned entry feed rate of the next one
+static bool picostepper_interpolation_run_next(PicoStepperInterpolation *interpolation) {
+  PicoStepperPath *path = &interpolation->queue[interpolation->queue_head];
+  interpolation->queue_head = (interpolation->queue_head + 1) % INTERPOLATION_LOOKAHEAD;
+  interpolation->queue_count--;
+
+  uint exit_feed_rate = 0;
+  if(interpolation->queue_count > 0) {
+    exit_feed_rate = interpolation->queue[interpolation->queue_head].entry_feed_rate;
+  }
+  uint entry_feed_rate = interpolation->feed_rate;
+  // The exit feed rate may not be reachable from the entry feed rate within the path
+  exit_feed_rate = (uint) min((uint64_t) exit_feed_rate, picostepper_reachable_feed_rate(interpolation, entry_feed_rate, path->length));
+  interpolation->feed_rate = exit_feed_rate;
+
+  // Error: The path leaves the reachable space, stop and drop the queued paths
+  if(!picostepper_interpolation_run(interpolation, path, entry_feed_rate, exit_feed_rate)) {
+    picostepper_stream_wait(interpolation->kinematics->devices, interpolation->kinematics->axes);
+    interpolation->queue_count = 0;
+    interpolation->feed_rate = 0;
+    return false;
+  }
+  return true;
+}
+
+// Get the position the next path starts at: the target of the last queued path or the current position
+static PicoStepperPoint picostepper_interpolation_position(const PicoStepperInterpolation *interpolation) {
+  if(interpolation->queue_count == 0) {
+    return interpolation->kinematics->position;
+  }
+  return interpolation->queue[(interpolation->queue_head + interpolation->queue_count - 1) % INTERPOLATION_LOOKAHEAD].target;
+}
+
+// Queue a path, running the oldest queued path if the queue is full
+static bool picostepper_interpolation_queue(PicoStepperInterpolation *interpolation, PicoStepperPath *path, uint feed_rate) {
+  // Error: The target is out of reach
+  int target_steps[1][KINEMATICS_MAX_AXES];
+  if(!picostepper_kinematics_transform(interpolation->kinematics, &path->target, target_steps, 1)) {
+    return false;
+  }
+
+  path->feed_rate = feed_rate;
+  // A movement starts at rest, a following path at the feed rate both paths and the corner between them allow
+  path->max_entry_feed_rate = 0;
+  if(interpolation->queue_count > 0) {
+    const PicoStepperPath *previous = &interpolation->queue[(interpolation->queue_head + interpolation->queue_count - 1) % INTERPOLATION_LOOKAHEAD];
+    path->max_entry_feed_rate = min(min(previous->feed_rate, feed_rate), picostepper_junction_feed_rate(interpolation, previous->end_direction, path->start_direction));
+  }
+
+  bool result = true;
+  if(interpolation->queue_count == INTERPOLATION_LOOKAHEAD) {
+    result = picostepper_interpolation_run_next(interpolation);
+    // The path started from the queued ones, which have been dropped
+    if(!result) {
+      return false;
+    }
+  }
+  interpolation->queue[(interpolation->queue_head + interpolation->queue_count) % INTERPOLATION_LOOKAHEAD] = *path;
+  interpolation->queue_count++;
+  picostepper_interpolation_plan(interpolation);
+  return result;
+}
+
+// Run all queued paths, decelerating to rest at the end of the last one, and wait for the movement to finish
+// Returns false if a path left the reachable space
+bool picostepper_interpolation_finish(PicoStepperInterpolation *interpolation) {
+  bool result = true;
+  while (result && interpolation->queue_count > 0)
+  {
+    result = picostepper_interpolation_run_next(interpolation);
+  }
+  picostepper_stream_wait(interpolation->kinematics->devices, interpolation->kinematics->axes);
+  interpolation->feed_rate = 0;
+  return result;
+}
+
+// Queue a straight line to a cartesian target at a constant feed rate (um/s), like G1
+// The line runs once the following paths are known or the movement is finished with picostepper_interpolation_finish
+bool picostepper_line_to(PicoStepperInterpolation *interpolation, PicoStepperPoint target, uint feed_rate) {
+  // Error: No feed rate
+  if(feed_rate == 0) {
+    return false;
+  }
+
+  PicoStepperPath path;
+  path.start = picostepper_interpolation_position(interpolation);
+  path.target = target;
+  path.is_arc = false;
+
+  int64_t dx = (int64_t) target.x - path.start.x;
+  int64_t dy = (int64_t) target.y - path.start.y;
+  int64_t dz = (int64_t) target.z - path.start.z;
+  path.length = picostepper_kinematics_sqrt((uint64_t) (dx * dx + dy * dy + dz * dz));
+  path.chord_length = path.length;
+  if(path.length == 0) {
+    return true;
+  }
+
+  double direction[3] = {(double) dx / path.length, (double) dy / path.length, (double) dz / path.length};
+  for (size_t i = 0; i < 3; i++)
+  {
+    path.start_direction[i] = direction[i];
+    path.end_direction[i] = direction[i];
+  }
+  return picostepper_interpolation_queue(interpolation, &path, feed_rate);
+}
+
+// Queue an arc to a cartesian target around the center (um, relative to the start of the arc) in the XY plane
+// at a constant feed rate (um/s), like G2 (clockwise) and G3. Z moves linearly, giving a helix.
+// The arc is approximated by chords, deviating at most by the tolerance from it.
+// Returns false if the distance of the target to the center differs from the radius by more than the tolerance.
+bool picostepper_arc_to(PicoStepperInterpolation *interpolation, PicoStepperPoint target, int32_t center_x, int32_t center_y, bool clockwise, uint feed_rate) {
+  // Error: No feed rate
+  if(feed_rate == 0) {
+    return false;
+  }
+
+  PicoStepperPath path;
+  path.start = picostepper_interpolation_position(interpolation);
+  path.target = target;
+  path.is_arc = true;
+  path.center_x = (double) path.start.x + center_x;
+  path.center_y = (double) path.start.y + center_y;
+  path.radius = hypot((double) center_x, (double) center_y);
+  // Error: No radius
+  if(path.radius < 1) {
+    return false;
+  }
+  // Error: The target is not on the arc
+  double end_radius = hypot((double) target.x - path.center_x, (double) target.y - path.center_y);
+  if(fabs(end_radius - path.radius) > interpolation->tolerance) {
+    return false;
+  }
+
+  // Sweep in the direction of the arc, a target equal to the start gives a full circle
+  path.start_angle = atan2(-(double) center_y, -(double) center_x);
+  double end_angle = atan2((double) target.y - path.center_y, (double) target.x - path.center_x);
+  path.sweep = end_angle - path.start_angle;
+  if(clockwise && path.sweep >= 0) {
+    path.sweep -= 2 * M_PI;
+  } else if(!clockwise && path.sweep <= 0) {
+    path.sweep += 2 * M_PI;
+  }
+
+  double dz = (double) target.z - path.start.z;
+  double planar_length = path.radius * fabs(path.sweep);
+  path.length = (uint) lround(sqrt(planar_length * planar_length + dz * dz));
+
+  // Largest angle of a chord that stays within the tolerance: r - r*cos(angle/2) <= tolerance
+  double chord_angle = M_PI / 2;
+  if(interpolation->tolerance < path.radius) {
+    chord_angle = min(2 * acos(1 - (double) interpolation->tolerance / path.radius), M_PI / 2);
+  }
+  path.chord_length = max((uint) (chord_angle / fabs(path.sweep) * path.length), 1);
+
+  // Tangents of the helix at its ends
+  double sign = path.sweep > 0 ? 1.0 : -1.0;
+  double angles[2] = {path.start_angle, path.start_angle + path.sweep};
+  double *directions[2] = {path.start_direction, path.end_direction};
+  for (size_t i = 0; i < 2; i++)
+  {
+    directions[i][0] = -sign * sin(angles[i]) * planar_length / path.length;
+    directions[i][1] = sign * cos(angles[i]) * planar_length / path.length;
+    directions[i][2] = dz / path.length;
+  }
+
+  // Following the arc takes a centripetal acceleration of v^2/r, and the chords meet at corners of chord_angle
+  if(interpolation->acceleration > 0) {
+    double from[3] = {1, 0, 0};
+    double to[3] = {cos(chord_angle), sin(chord_angle), 0};
+    double arc_feed_rate = sqrt((double) interpolation->acceleration * path.radius);
+    arc_feed_rate = min(arc_feed_rate, (double) picostepper_junction_feed_rate(interpolation, from, to));
+    feed_rate = (uint) max(min((double) feed_rate, arc_feed_rate), 1.0);
+  }
+  return picostepper_interpolation_queue(interpolation, &path, feed_rate);
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+
+#ifndef PICOSTEPPER_INTERPOLATION_H
+#define PICOSTEPPER_INTERPOLATION_H
+
+#define INTERPOLATION_TOLERANCE 10 // Default maximum deviation (um) of the chords of an arc from the arc
+#define INTERPOLATION_SEGMENT_LENGTH 500 // Default length (um) of the segments while accelerating and decelerating
+#define INTERPOLATION_JUNCTION_DEVIATION 20 // Default distance (um) a junction between two paths may be rounded off by
+#define INTERPOLATION_LOOKAHEAD 8 // Number of paths queued to plan the feed rates at their junctions, at least 2
+
+#include "kinematics.h"
+
+// Geometry of a line or a (helical) arc in the XY plane
+struct picostepper_path_def {
+  PicoStepperPoint start;
+  PicoStepperPoint target;
+  bool is_arc;
+  double center_x; // um
+  double center_y; // um
+  double radius; // um
+  double start_angle; // rad
+  double sweep; // rad, negative for clockwise arcs
+  uint length; // um
+  uint chord_length; // um, length of the segments the path can be approximated with
+  double start_direction[3]; // Unit vector the path starts in
+  double end_direction[3]; // Unit vector the path ends in
+  uint feed_rate; // um/s
+  uint max_entry_feed_rate; // um/s, limited by the junction with the previous path
+  uint entry_feed_rate; // um/s, planned so the queued paths can stop at the end of the last one
+};
+typedef struct picostepper_path_def PicoStepperPath;
+
+// Settings for the interpolation of paths on a machine and the queue of paths that are yet to be run
+struct picostepper_interpolation_def {
+  PicoStepperKinematics *kinematics;
+  uint tolerance; // um
+  uint segment_length; // um
+  uint acceleration; // um/s^2, 0 runs at the feed rate right away
+  uint junction_deviation; // um
+  PicoStepperPath queue[INTERPOLATION_LOOKAHEAD];
+  uint queue_head;
+  uint queue_count;
+  uint feed_rate; // um/s the machine moves at when the oldest queued path starts
+};
+typedef struct picostepper_interpolation_def PicoStepperInterpolation;
+
+void picostepper_interpolation_init(PicoStepperInterpolation *interpolation, PicoStepperKinematics *kinematics);
+void picostepper_interpolation_set_tolerance(PicoStepperInterpolation *interpolation, float tolerance);
+void picostepper_interpolation_set_segment_length(PicoStepperInterpolation *interpolation, float length);
+void picostepper_interpolation_set_acceleration(PicoStepperInterpolation *interpolation, float acceleration);
+void picostepper_interpolation_set_junction_deviation(PicoStepperInterpolation *interpolation, float deviation);
+bool picostepper_line_to(PicoStepperInterpolation *interpolation, PicoStepperPoint target, uint feed_rate);
+bool picostepper_arc_to(PicoStepperInterpolation *interpolation, PicoStepperPoint target, int32_t center_x, int32_t center_y, bool clockwise, uint feed_rate);
+bool picostepper_interpolation_finish(PicoStepperInterpolation *interpolation);
+
+#endif
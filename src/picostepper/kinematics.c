@@ -0,0 +1,268 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+
+#include "kinematics.h"
+
+// Convert a distance in um into steps using a Q16 steps/mm factor, rounding to the nearest step
+static inline int picostepper_kinematics_steps(int64_t distance, int64_t steps_per_mm) {
+  int64_t scaled = distance * steps_per_mm;
+  int64_t divisor = (int64_t) 1000 << 16;
+  return (int) ((scaled + (scaled >= 0 ? divisor / 2 : -divisor / 2)) / divisor);
+}
+
+// Integer square root, used for lengths and the delta transform
+uint32_t picostepper_kinematics_sqrt(uint64_t value) {
+  uint64_t result = 0;
+  uint64_t bit = (uint64_t) 1 << 62;
+  while (bit > value) bit >>= 2;
+  while (bit != 0)
+  {
+    if(value >= result + bit) {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t) result;
+}
+
+// Set up the kinematics for a machine, devices[i] drives motor i with steps_per_mm[i] steps per mm
+bool picostepper_kinematics_init(PicoStepperKinematics *kinematics, PicoStepperKinematicsType type, PicoStepper devices[], uint axes, float steps_per_mm[]) {
+  // Error: Invalid number of motors for the geometry
+  if(axes == 0 || axes > KINEMATICS_MAX_AXES) {
+    return false;
+  }
+  if((type == CoreXYKinematics || type == HBotKinematics) && axes < 2) {
+    return false;
+  }
+  if(type == DeltaKinematics && axes != 3) {
+    return false;
+  }
+
+  kinematics->type = type;
+  kinematics->axes = axes;
+  for (size_t axis = 0; axis < axes; axis++)
+  {
+    kinematics->devices[axis] = devices[axis];
+    kinematics->steps_per_mm[axis] = (int64_t) ((double) steps_per_mm[axis] * 65536.0 + 0.5);
+    kinematics->max_speed[axis] = 0;
+    kinematics->tower_x[axis] = 0;
+    kinematics->tower_y[axis] = 0;
+  }
+  kinematics->arm_length_squared = 0;
+  kinematics->segment_length = KINEMATICS_SEGMENT_LENGTH;
+  kinematics->position.x = 0;
+  kinematics->position.y = 0;
+  kinematics->position.z = 0;
+  return true;
+}
+
+// Set the geometry of a linear delta: the length of the diagonal arms and the horizontal distance
+// between the center and the towers (including the offsets of effector and carriages), both in mm
+void picostepper_kinematics_set_delta(PicoStepperKinematics *kinematics, float arm_length, float radius) {
+  int64_t arm = (int64_t) ((double) arm_length * 1000.0 + 0.5);
+  kinematics->arm_length_squared = arm * arm;
+
+  double angles[KINEMATICS_MAX_AXES] = {210.0, 330.0, 90.0};
+  for (size_t axis = 0; axis < KINEMATICS_MAX_AXES; axis++)
+  {
+    double angle = angles[axis] * M_PI / 180.0;
+    kinematics->tower_x[axis] = (int32_t) lround((double) radius * 1000.0 * cos(angle));
+    kinematics->tower_y[axis] = (int32_t) lround((double) radius * 1000.0 * sin(angle));
+  }
+}
+
+// Set the length (mm) of the segments movements of non linear kinematics are subdivided into
+void picostepper_kinematics_set_segment_length(PicoStepperKinematics *kinematics, float length) {
+  kinematics->segment_length = max((uint) ((double) length * 1000.0 + 0.5), 1);
+}
+
+// Limit the speed (steps/second) of a motor, movements are slowed down to stay within all limits
+void picostepper_kinematics_set_max_speed(PicoStepperKinematics *kinematics, uint axis, uint speed) {
+  kinematics->max_speed[axis] = speed;
+}
+
+// Set the cartesian position of the machine and the positions of its motors accordingly
+void picostepper_kinematics_set_position(PicoStepperKinematics *kinematics, PicoStepperPoint position) {
+  int steps[1][KINEMATICS_MAX_AXES];
+  kinematics->position = position;
+  if(!picostepper_kinematics_transform(kinematics, &position, steps, 1)) {
+    return;
+  }
+  for (size_t axis = 0; axis < kinematics->axes; axis++)
+  {
+    picostepper_set_position(kinematics->devices[axis], steps[0][axis]);
+  }
+}
+
+// Transform count cartesian points into the step positions of the motors
+// Returns false if a point can not be reached
+bool picostepper_kinematics_transform(PicoStepperKinematics *kinematics, const PicoStepperPoint points[], int steps[][KINEMATICS_MAX_AXES], uint count) {
+  switch(kinematics->type){
+    case CartesianKinematics:
+      for (size_t i = 0; i < count; i++)
+      {
+        int32_t coordinates[KINEMATICS_MAX_AXES] = {points[i].x, points[i].y, points[i].z};
+        for (size_t axis = 0; axis < kinematics->axes; axis++)
+        {
+          steps[i][axis] = picostepper_kinematics_steps(coordinates[axis], kinematics->steps_per_mm[axis]);
+        }
+      }
+      return true;
+
+    case CoreXYKinematics:
+    case HBotKinematics:
+      for (size_t i = 0; i < count; i++)
+      {
+        steps[i][0] = picostepper_kinematics_steps((int64_t) points[i].x + points[i].y, kinematics->steps_per_mm[0]);
+        steps[i][1] = picostepper_kinematics_steps((int64_t) points[i].x - points[i].y, kinematics->steps_per_mm[1]);
+        if(kinematics->axes > 2) {
+          steps[i][2] = picostepper_kinematics_steps(points[i].z, kinematics->steps_per_mm[2]);
+        }
+      }
+      return true;
+
+    case DeltaKinematics:
+      for (size_t i = 0; i < count; i++)
+      {
+        for (size_t axis = 0; axis < KINEMATICS_MAX_AXES; axis++)
+        {
+          // Height of the carriage above the effector: sqrt(arm^2 - horizontal distance^2)
+          int64_t dx = (int64_t) kinematics->tower_x[axis] - points[i].x;
+          int64_t dy = (int64_t) kinematics->tower_y[axis] - points[i].y;
+          int64_t height_squared = kinematics->arm_length_squared - dx * dx - dy * dy;
+          // Error: The point is out of reach of the arm
+          if(height_squared < 0) {
+            return false;
+          }
+          int64_t carriage = (int64_t) points[i].z + picostepper_kinematics_sqrt((uint64_t) height_squared);
+          steps[i][axis] = picostepper_kinematics_steps(carriage, kinematics->steps_per_mm[axis]);
+        }
+      }
+      return true;
+
+    // Other kinematics are not yet implemented
+    default:  return false;
+  }
+}
+
+// Calculate the speed (steps/second) of every motor to move from its current to the given step position,
+// so that a segment of length um is traveled at feed_rate um/s without exceeding the speed limits of the motors
+void picostepper_kinematics_speeds(PicoStepperKinematics *kinematics, int positions[], uint length, uint feed_rate, uint speeds[]) {
+  uint64_t duration = max(((uint64_t) length * 1000000) / max(feed_rate, 1), 1);
+  uint steps[KINEMATICS_MAX_AXES];
+
+  for (size_t axis = 0; axis < kinematics->axes; axis++)
+  {
+    steps[axis] = abs(positions[axis] - psc.devices[kinematics->devices[axis]].position);
+    uint64_t speed = ((uint64_t) steps[axis] * 1000000) / duration;
+    if(kinematics->max_speed[axis] > 0 && speed > kinematics->max_speed[axis]) {
+      duration = ((uint64_t) steps[axis] * 1000000 + kinematics->max_speed[axis] - 1) / kinematics->max_speed[axis];
+    }
+  }
+
+  // Give every motor the speed that makes all of them arrive at the same time
+  for (size_t axis = 0; axis < kinematics->axes; axis++)
+  {
+    speeds[axis] = max((uint) (((uint64_t) steps[axis] * 1000000) / duration), 1);
+  }
+}
+
+// Move all motors from their current to the given step positions, traveling a segment of length um at feed_rate um/s
+static void picostepper_kinematics_move_segment(PicoStepperKinematics *kinematics, int positions[], uint length, uint feed_rate) {
+  uint speeds[KINEMATICS_MAX_AXES];
+  picostepper_kinematics_speeds(kinematics, positions, length, feed_rate, speeds);
+  picostepper_move_to_positions_at(kinematics->devices, positions, speeds, kinematics->axes, false);
+}
+
+// Get the acceleration (um/s^2) along a path that none of the motors with an acceleration exceeds, 0 if none has one
+static uint picostepper_kinematics_acceleration(PicoStepperKinematics *kinematics) {
+  uint64_t acceleration = 0;
+  for (size_t axis = 0; axis < kinematics->axes; axis++)
+  {
+    uint64_t motor_acceleration = psc.devices[kinematics->devices[axis]].acceleration;
+    if(motor_acceleration == 0 || kinematics->steps_per_mm[axis] == 0) {
+      continue;
+    }
+    // steps/s^2 into um/s^2
+    uint64_t converted = (motor_acceleration * 1000 << 16) / (uint64_t) kinematics->steps_per_mm[axis];
+    acceleration = acceleration == 0 ? converted : min(acceleration, converted);
+  }
+  return (uint) min(acceleration, (uint64_t) UINT32_MAX);
+}
+
+// Move to a cartesian target in a straight line at feed_rate um/s
+// Non linear kinematics are subdivided into segments, which are transformed in batches and streamed to the motors,
+// accelerating along the path with the slowest acceleration of the motors
+bool picostepper_kinematics_move_to(PicoStepperKinematics *kinematics, PicoStepperPoint target, uint feed_rate) {
+  // Error: No feed rate
+  if(feed_rate == 0) {
+    return false;
+  }
+  // Error: The target is out of reach
+  int target_steps[1][KINEMATICS_MAX_AXES];
+  if(!picostepper_kinematics_transform(kinematics, &target, target_steps, 1)) {
+    return false;
+  }
+
+  PicoStepperPoint start = kinematics->position;
+  int64_t dx = (int64_t) target.x - start.x;
+  int64_t dy = (int64_t) target.y - start.y;
+  int64_t dz = (int64_t) target.z - start.z;
+  uint length = picostepper_kinematics_sqrt((uint64_t) (dx * dx + dy * dy + dz * dz));
+  if(length == 0) {
+    return true;
+  }
+
+  // Straight lines stay straight for linear kinematics, they are moved in one accelerated movement
+  if(kinematics->type != DeltaKinematics) {
+    picostepper_kinematics_move_segment(kinematics, target_steps[0], length, feed_rate);
+    kinematics->position = target;
+    return true;
+  }
+
+  uint segments = max((length + kinematics->segment_length - 1) / kinematics->segment_length, 1);
+  uint acceleration = picostepper_kinematics_acceleration(kinematics);
+
+  PicoStepperPoint points[KINEMATICS_BATCH];
+  int steps[KINEMATICS_BATCH][KINEMATICS_MAX_AXES];
+  uint speeds[KINEMATICS_MAX_AXES];
+  for (uint first = 1; first <= segments; first += KINEMATICS_BATCH)
+  {
+    uint count = min(segments - first + 1, KINEMATICS_BATCH);
+    for (size_t i = 0; i < count; i++)
+    {
+      int64_t segment = first + i;
+      points[i].x = start.x + (int32_t) ((dx * segment) / segments);
+      points[i].y = start.y + (int32_t) ((dy * segment) / segments);
+      points[i].z = start.z + (int32_t) ((dz * segment) / segments);
+    }
+    // Error: The movement leaves the reachable space
+    if(!picostepper_kinematics_transform(kinematics, points, steps, count)) {
+      picostepper_stream_wait(kinematics->devices, kinematics->axes);
+      return false;
+    }
+    // The next segment is prepared while the previous one is running
+    for (size_t i = 0; i < count; i++)
+    {
+      uint segment_feed_rate = feed_rate;
+      if(acceleration > 0) {
+        // v^2 = 2*a*s from the closer end of the movement, measured at the middle of the segment
+        uint64_t middle = (((uint64_t) 2 * (first + i) - 1) * length) / (2 * segments);
+        uint64_t to_end = min(middle, length - middle);
+        segment_feed_rate = max((uint) min((uint64_t) picostepper_kinematics_sqrt(2 * (uint64_t) acceleration * to_end), (uint64_t) feed_rate), 1);
+      }
+      picostepper_kinematics_speeds(kinematics, steps[i], length / segments, segment_feed_rate, speeds);
+      picostepper_stream_segment(kinematics->devices, steps[i], speeds, kinematics->axes);
+      kinematics->position = points[i];
+    }
+  }
+  picostepper_stream_wait(kinematics->devices, kinematics->axes);
+  return true;
+}
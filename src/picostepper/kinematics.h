@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+
+#ifndef PICOSTEPPER_KINEMATICS_H
+#define PICOSTEPPER_KINEMATICS_H
+
+#define KINEMATICS_MAX_AXES 3
+#define KINEMATICS_BATCH 16 // Number of points transformed at once when subdividing a movement
+#define KINEMATICS_SEGMENT_LENGTH 1000 // Default length (um) of the segments non linear kinematics are subdivided into
+
+#include "picostepper.h"
+
+// The supported machine geometries
+enum PicoStepperKinematicsType_def {
+  CartesianKinematics,  // Each motor drives one axis
+  CoreXYKinematics,     // A = X + Y, B = X - Y, the third motor drives Z
+  HBotKinematics,       // Same motor mapping as CoreXY, using a single belt
+  DeltaKinematics       // Linear delta, towers at 210, 330 and 90 degrees
+};
+typedef enum PicoStepperKinematicsType_def PicoStepperKinematicsType;
+
+// A cartesian position in micrometers
+struct picostepper_point_def {
+  int32_t x;
+  int32_t y;
+  int32_t z;
+};
+typedef struct picostepper_point_def PicoStepperPoint;
+
+// Geometry and state of a machine built from PicoStepper devices
+struct picostepper_kinematics_def {
+  PicoStepperKinematicsType type;
+  uint axes;
+  PicoStepper devices[KINEMATICS_MAX_AXES];
+  int64_t steps_per_mm[KINEMATICS_MAX_AXES]; // Q16 fixed point
+  uint max_speed[KINEMATICS_MAX_AXES]; // steps/second, 0 is unlimited
+  int64_t arm_length_squared; // um^2
+  int32_t tower_x[KINEMATICS_MAX_AXES]; // um
+  int32_t tower_y[KINEMATICS_MAX_AXES]; // um
+  uint segment_length; // um
+  PicoStepperPoint position;
+};
+typedef struct picostepper_kinematics_def PicoStepperKinematics;
+
+bool picostepper_kinematics_init(PicoStepperKinematics *kinematics, PicoStepperKinematicsType type, PicoStepper devices[], uint axes, float steps_per_mm[]);
+void picostepper_kinematics_set_delta(PicoStepperKinematics *kinematics, float arm_length, float radius);
+void picostepper_kinematics_set_segment_length(PicoStepperKinematics *kinematics, float length);
+void picostepper_kinematics_set_max_speed(PicoStepperKinematics *kinematics, uint axis, uint speed);
+void picostepper_kinematics_set_position(PicoStepperKinematics *kinematics, PicoStepperPoint position);
+bool picostepper_kinematics_transform(PicoStepperKinematics *kinematics, const PicoStepperPoint points[], int steps[][KINEMATICS_MAX_AXES], uint count);
+void picostepper_kinematics_speeds(PicoStepperKinematics *kinematics, int positions[], uint length, uint feed_rate, uint speeds[]);
+bool picostepper_kinematics_move_to(PicoStepperKinematics *kinematics, PicoStepperPoint target, uint feed_rate);
+uint32_t picostepper_kinematics_sqrt(uint64_t value);
+
+#endif
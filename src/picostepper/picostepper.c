@@ -32,6 +32,10 @@ static void picostepper_async_handler() {
     PicoStepper device = (PicoStepper) psc.map_dma_ch_to_device_index[dma_channel];
     // Invoke callback for device
     psc.devices[device].is_running = false;
+    // Advance the profile time of the input shaper by the duration of the steps that have just been streamed
+    if(psc.devices[device].shaper.speed > 0) {
+      psc.devices[device].shaper.time += (uint32_t) (((uint64_t) psc.devices[device].slice_steps * 1000000) / psc.devices[device].shaper.speed);
+    }
     if(psc.devices[device].callback != NULL) {
       (*psc.devices[device].callback)(device);
     }
@@ -47,12 +51,47 @@ static PicoStepperRawDevice picostepper_create_raw_device() {
   psrq.steps = 0;
   psrq.position = 0;
   psrq.acceleration = 0;
+  psrq.coasting_slices = 0;
+  psrq.stack = NULL;
+  psrq.max_speed = MAXSTEPRATE;
+  psrq.moving_max_speed = MAXSTEPRATE;
+  psrq.min_speed = MINSPEED;
   psrq.enabled = false;
   psrq.command = 0;
   psrq.pio_id = -1;
   psrq.callback = NULL;
   psrq.dma_config = dma_channel_get_default_config(0);
   psrq.delay = 1;
+  psrq.driver = FourWireDriver;
+  psrq.polarity = false;
+  psrq.min_delay = MINDELAY;
+  psrq.velocity_mode = false;
+  psrq.target_velocity = 0;
+  psrq.velocity = 0;
+  psrq.velocity_callback = NULL;
+  psrq.step_position = 0;
+  psrq.slice_direction = 0;
+  psrq.slice_steps = 0;
+  psrq.queued_direction = 0;
+  psrq.queued_steps = 0;
+  psrq.encoder_is_configured = false;
+  psrq.encoder_counts = 1;
+  psrq.encoder_steps = 1;
+  psrq.encoder_offset = 0;
+  psrq.encoder_origin = 0;
+  psrq.pending_correction = 0;
+  psrq.stall_threshold = 0;
+  psrq.is_stalled = false;
+  psrq.stall_callback = NULL;
+  psrq.shaper.type = NoShaper;
+  psrq.shaper.impulses = 0;
+  psrq.shaper.time = 0;
+  psrq.shaper.speed = 0;
+  psrq.shaper.is_settled = true;
+  psrq.shaper.remaining_steps = 0;
+  psrq.shaper.callback = NULL;
+  psrq.shaper.history_head = 0;
+  psrq.shaper.history_count = 0;
   return psrq;
 }
 
@@ -71,12 +110,33 @@ static void picostepper_psc_init() {
   {
     psc.map_dma_ch_to_device_index[i] = -1;
   }
+  psc.encoder_program_is_loaded[0] = false;
+  psc.encoder_program_is_loaded[1] = false;
+  psc.encoder_timer_is_running = false;
+  psc.program_count[0] = 0;
+  psc.program_count[1] = 0;
+#if PICOSTEPPER_TRACE
+  psc.trace_count = 0;
+  psc.trace_is_running = false;
+  psc.trace_is_full = false;
+#endif
   psc_is_initialised = true;
   return;
 }
 
-// Allocate hardware resources for a stepper
-static PicoStepper picostepper_init_unclaimed_device() {
+// Check if a program is loaded on a PIO-Block or there is enough instruction memory left to load it
+static bool picostepper_program_fits(int pio_id, const pio_program_t *program) {
+  for (size_t i = 0; i < psc.program_count[pio_id]; i++)
+  {
+    if(psc.programs[pio_id][i] == program) {
+      return true;
+    }
+  }
+  return pio_can_add_program(pio_id == 0 ? pio0 : pio1, program);
+}
+
+// Allocate hardware resources for a stepper running the given program
+static PicoStepper picostepper_init_unclaimed_device(const pio_program_t *program) {
   // Initialize the PicoStepperContainer (if neccessary)
   picostepper_psc_init();
   // Select an PicoStepper device that is not in use (if possible)
@@ -94,14 +154,24 @@ static PicoStepper picostepper_init_unclaimed_device() {
     return (PicoStepper) -1;
   }
   // Select a PIO-Block and statemachine to generate the signal on
+  // Blocks without room for the program are skipped, e.g. when an encoder occupies the instruction memory of pio1
   PIO pio_block = pio0;
   int pio_id = 0;
-  uint statemachine = pio_claim_unused_sm(pio_block, false);
+  int statemachine = -1;
+  for (pio_id = 0; pio_id < 2; pio_id++)
+  {
+    pio_block = pio_id == 0 ? pio0 : pio1;
+    if(!picostepper_program_fits(pio_id, program)) {
+      continue;
+    }
+    statemachine = pio_claim_unused_sm(pio_block, false);
+    if(statemachine != -1) {
+      break;
+    }
+  }
   // Error: No free resources to use for the stepper
   if(statemachine == -1) {
-    pio_block = pio1;
-    pio_id = 1;
-    statemachine = pio_claim_unused_sm(pio_block, true);
+    return (PicoStepper) -1;
   }
   // Select a DMA-Channel and configure it
   int dma_ch = dma_claim_unused_channel(true);
@@ -128,70 +198,158 @@ static PicoStepper picostepper_init_unclaimed_device() {
   return (PicoStepper) unclaimed_device_index;
 }
 
-PicoStepper picostepper_init(uint base_pin, PicoStepperMotorType driver) {
-  // Choose the programm to generate the steps
-  const pio_program_t * picostepper_driver_program;
-  //picostepper_driver_program = &picostepper_four_wire_program;
-  switch(driver){
-    case FourWireDriver: 
-      picostepper_driver_program = &picostepper_four_wire_program;
-      break;
+// Descriptors of all drivers, resolved at compile time from PICOSTEPPER_DRIVERS
+#define PICOSTEPPER_DRIVER_DESCRIPTOR(type, program, reversed_program, pins, polarity, pulse_width, dir_setup) \
+  [type] = { \
+    &program##_program, &reversed_program##_program, \
+    &program##_program_get_default_config, &reversed_program##_program_get_default_config, \
+    pins, polarity, PICOSTEPPER_MIN_DELAY(pulse_width, dir_setup) \
+  },
+const PicoStepperDriver picostepper_drivers[PicoStepperDriverCount] = {
+  PICOSTEPPER_DRIVERS(PICOSTEPPER_DRIVER_DESCRIPTOR)
+};
+#undef PICOSTEPPER_DRIVER_DESCRIPTOR
+
+// PUL is high for a fixed number of cycles, which has to cover the pulse width of every driver
+#define PICOSTEPPER_DRIVER_ASSERT(type, program, reversed_program, pins, polarity, pulse_width, dir_setup) \
+  _Static_assert(PICOSTEPPER_CYCLES(pulse_width) <= PICOSTEPPER_HIGH_CYCLES, #type ": pulse width exceeds the PUL high time, increase CLKDIV");
+PICOSTEPPER_DRIVERS(PICOSTEPPER_DRIVER_ASSERT)
+#undef PICOSTEPPER_DRIVER_ASSERT
+
+// Load a program into the instruction memory of a PIO-Block, unless it has already been loaded there
+static uint picostepper_load_program(int pio_id, const pio_program_t *program) {
+  for (size_t i = 0; i < psc.program_count[pio_id]; i++)
+  {
+    if(psc.programs[pio_id][i] == program) {
+      return psc.program_offsets[pio_id][i];
+    }
+  }
+  PIO pio_block = pio_id == 0 ? pio0 : pio1;
+  uint offset = pio_add_program(pio_block, program);
+  psc.programs[pio_id][psc.program_count[pio_id]] = program;
+  psc.program_offsets[pio_id][psc.program_count[pio_id]] = offset;
+  psc.program_count[pio_id]++;
+  return offset;
+}
 
-    case TwoWireDriver:
-      picostepper_driver_program = &picostepper_two_wire_program;
-      break;
+// Start the program of a driver on the statemachine of a device, driving the pins from base_pin on
+static void picostepper_driver_init(PicoStepper device, PicoStepperMotorType driver, bool reversed, uint base_pin) {
+  const PicoStepperDriver *descriptor = &picostepper_drivers[driver];
+  PIO pio = psc.devices[device].pio;
+  uint sm = psc.devices[device].statemachine;
 
-    // Other drivers are not yet implemented
-    default:  return -1;
-  }
-  // Create picostepper object and claim pio resources
-  PicoStepper device = picostepper_init_unclaimed_device();
   // Load the driver program into the pio instruction memory
-  uint picostepper_program_offset = pio_add_program(psc.devices[device].pio, picostepper_driver_program);
-  // Init PIO program
+  uint offset = picostepper_load_program(psc.devices[device].pio_id, reversed ? descriptor->reversed_program : descriptor->program);
 
-  switch(driver){
-    case FourWireDriver:   
-      picostepper_four_wire_program_init(psc.devices[device].pio, psc.devices[device].statemachine, picostepper_program_offset, base_pin, CLKDIV);
-      break;
+  // General configuration for the pio systems
+  pio_sm_config c = reversed ? descriptor->get_reversed_default_config(offset) : descriptor->get_default_config(offset);
+  sm_config_set_clkdiv(&c, CLKDIV);
+  sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
 
-      case TwoWireDriver:   
-      picostepper_two_wire_program_init(psc.devices[device].pio, psc.devices[device].statemachine, picostepper_program_offset, base_pin, CLKDIV);
-      break;
-      
-    // Other drivers are not yet implemented
-    default:  return -1;
+  // SET PINS
+  for (size_t pin = 0; pin < descriptor->pin_count; pin++)
+  {
+    pio_gpio_init(pio, base_pin + pin);
   }
-  
-  
+  pio_sm_set_consecutive_pindirs(pio, sm, base_pin, descriptor->pin_count, true);
+  pio_sm_set_set_pins(pio, sm, base_pin, descriptor->pin_count);
+  sm_config_set_set_pins(&c, base_pin, descriptor->pin_count);
+
+  // Start PIO-Program
+  pio_sm_init(pio, sm, offset, &c);
+  pio_sm_set_enabled(pio, sm, true);
+
+  psc.devices[device].driver = driver;
+  psc.devices[device].polarity = descriptor->polarity;
+  psc.devices[device].min_delay = max(descriptor->min_delay, MINDELAY);
+}
+
+PicoStepper picostepper_init(uint base_pin, PicoStepperMotorType driver) {
+  // Error: Unknown driver
+  if(driver < 0 || driver >= PicoStepperDriverCount) {
+    return -1;
+  }
+  // Create picostepper object and claim pio resources
+  PicoStepper device = picostepper_init_unclaimed_device(picostepper_drivers[driver].program);
+  // Error: No free resources to use for the stepper
+  if(device == -1) {
+    return -1;
+  }
+  picostepper_driver_init(device, driver, false, base_pin);
   return device;
 }
 
 PicoStepper picostepper_pindef_init(uint dir_pin, uint step_pin, PicoStepperMotorType driver) {
-  // Choose the programm to generate the steps
-  const pio_program_t * picostepper_driver_program;
+  // Error: Unknown driver or a driver that does not use a single DIR and PUL pin
+  if(driver < 0 || driver >= PicoStepperDriverCount || picostepper_drivers[driver].pin_count != 2) {
+    return -1;
+  }
+  // The programs drive PUL on the lower and DIR on the higher pin, the reversed programs the other way around
+  bool reversed = dir_pin <= step_pin;
   // Create picostepper object and claim pio resources
-  PicoStepper device = picostepper_init_unclaimed_device();
-
-  if(dir_pin > step_pin){
-
-  picostepper_driver_program = &picostepper_two_wire_program;
-  // Load the driver program into the pio instruction memory
-  uint picostepper_program_offset = pio_add_program(psc.devices[device].pio, picostepper_driver_program);
-  // Init PIO program
-  picostepper_two_wire_program_init(psc.devices[device].pio, psc.devices[device].statemachine, picostepper_program_offset, step_pin, CLKDIV);
+  PicoStepper device = picostepper_init_unclaimed_device(reversed ? picostepper_drivers[driver].reversed_program : picostepper_drivers[driver].program);
+  // Error: No free resources to use for the stepper
+  if(device == -1) {
+    return -1;
+  }
+  picostepper_driver_init(device, driver, reversed, reversed ? dir_pin : step_pin);
+  return device;
+}
 
+// Record a command handed to the PIO of a device while a trace is running
+static inline void picostepper_trace_record(PicoStepper device, uint steps, uint32_t command) {
+#if PICOSTEPPER_TRACE
+  if(!psc.trace_is_running) {
+    return;
+  }
+  uint32_t interrupts = save_and_disable_interrupts();
+  if(psc.trace_count < TRACE_SIZE) {
+    PicoStepperTraceRecord *record = &psc.trace[psc.trace_count++];
+    record->time = time_us_64();
+    record->device = device;
+    record->polarity = psc.devices[device].polarity;
+    record->steps = steps;
+    record->command = command;
   } else {
+    psc.trace_is_full = true;
+  }
+  restore_interrupts(interrupts);
+#endif
+}
 
-    picostepper_driver_program = &picostepper_two_wire_reversed_program;
-    // Load the driver program into the pio instruction memory
-    uint picostepper_program_offset = pio_add_program(psc.devices[device].pio, picostepper_driver_program);
-    // Init PIO program
-    picostepper_two_wire_reversed_program_init(psc.devices[device].pio, psc.devices[device].statemachine, picostepper_program_offset, dir_pin, CLKDIV);
+// Update the command repeated by the DMA, a running movement uses it once the queued commands have been consumed
+// Commands are not shaped, unless picostepper_set_profile_delay shapes them afterwards
+static void picostepper_set_command(PicoStepper device, uint32_t command) {
+  psc.devices[device].command = command;
+  psc.devices[device].shaper.speed = 0;
+  if(psc.devices[device].is_running) {
+    picostepper_trace_record(device, 0, command);
+  }
+}
 
+// Start tracking the steps of a new slice for the step counted position
+// Steps of the previous slices may still wait in the TX FIFO, they are queued and counted once the PIO has taken them
+static void picostepper_track_slice(PicoStepper device, uint steps, int direction) {
+  uint32_t interrupts = save_and_disable_interrupts();
+  uint fifo_level = pio_sm_get_tx_fifo_level(psc.devices[device].pio, psc.devices[device].statemachine);
+  uint unaccounted = psc.devices[device].queued_steps + psc.devices[device].slice_steps;
+  uint taken = unaccounted - min(fifo_level, unaccounted);
+  // The queued steps leave the FIFO before the ones of the slice
+  uint queued_taken = min(taken, psc.devices[device].queued_steps);
+  uint queued_left = psc.devices[device].queued_steps - queued_taken;
+  uint slice_left = psc.devices[device].slice_steps - (taken - queued_taken);
+  psc.devices[device].step_position += psc.devices[device].queued_direction * (int) queued_taken;
+  psc.devices[device].step_position += psc.devices[device].slice_direction * (int) (taken - queued_taken);
+  // Queued steps in both directions only occur when reversing within the depth of the FIFO, the older ones count right away
+  if(queued_left > 0 && slice_left > 0 && psc.devices[device].queued_direction != psc.devices[device].slice_direction) {
+    psc.devices[device].step_position += psc.devices[device].queued_direction * (int) queued_left;
+    queued_left = 0;
   }
-  
-  return device;
+  if(slice_left > 0) psc.devices[device].queued_direction = psc.devices[device].slice_direction;
+  psc.devices[device].queued_steps = queued_left + slice_left;
+  psc.devices[device].slice_steps = steps;
+  psc.devices[device].slice_direction = direction;
+  restore_interrupts(interrupts);
 }
 
 // Move the stepper and wait for it to finish before returning from the function
@@ -210,19 +368,26 @@ bool picostepper_move_blocking(PicoStepper device, uint steps, bool direction, u
   if(psc.devices[device].is_running) {
     return false;
   }
+  // Track the steps for the step counted position while moving, the slice grows with every command put into the FIFO
+  picostepper_track_slice(device, 0, direction ? 1 : -1);
   // Set device status to running
   psc.devices[device].is_running = true;
   // For each step submit a step command to the pio
   uint32_t command;
   uint calculated_delay = delay;
+  bool driver_direction = direction ^ psc.devices[device].polarity;
   for (size_t i = 0; i < steps; i++)
   {
-    command = (((calculated_delay << 1) | (direction ^ DRIVER)) << 1 ) | 1;
+    command = picostepper_encode_command(max(calculated_delay, psc.devices[device].min_delay), driver_direction, true);
     pio_sm_put_blocking(psc.devices[device].pio, psc.devices[device].statemachine, command);
+    psc.devices[device].slice_steps++;
+    picostepper_trace_record(device, 1, command);
     calculated_delay += delay_change;
   }
   // Wait until the statemachine has consumed all commands from the buffer
   while (pio_sm_is_tx_fifo_empty(psc.devices[device].pio, psc.devices[device].statemachine) == false);
+  // Update the step counted position
+  picostepper_track_slice(device, 0, psc.devices[device].slice_direction);
   // Set device status to not running
   psc.devices[device].is_running = false;
   return true;
@@ -231,15 +396,15 @@ bool picostepper_move_blocking(PicoStepper device, uint steps, bool direction, u
 // Set the direction used by picostepper_move_async.
 // Can be set during a running async movement.
 void picostepper_set_async_direction(PicoStepper device, bool direction) {
-  psc.devices[device].direction = direction ^ DRIVER;
-  psc.devices[device].command = (((psc.devices[device].delay << 1) | psc.devices[device].direction) << 1 )| psc.devices[device].enabled;
+  psc.devices[device].direction = direction ^ psc.devices[device].polarity;
+  picostepper_set_command(device, picostepper_encode_command(psc.devices[device].delay, psc.devices[device].direction, psc.devices[device].enabled));
 }
 
 // Set the enabled state for step-commands send by picostepper_move_async
 // Can be set during a running async movement.
 void picostepper_set_async_enabled(PicoStepper device, bool enabled) {
   psc.devices[device].enabled = enabled;
-  psc.devices[device].command = (((psc.devices[device].delay << 1) | psc.devices[device].direction) << 1 )| psc.devices[device].enabled;
+  picostepper_set_command(device, picostepper_encode_command(psc.devices[device].delay, psc.devices[device].direction, psc.devices[device].enabled));
 }
 
 bool picostepper_get_async_enabled(PicoStepper device){
@@ -249,8 +414,8 @@ bool picostepper_get_async_enabled(PicoStepper device){
 // Set the delay between steps used by picostepper_move_async.
 // Can be set during a running async movement.
 void picostepper_set_async_delay(PicoStepper device, uint delay) {
-  psc.devices[device].delay = max(delay, MINDELAY);
-  psc.devices[device].command = (((psc.devices[device].delay << 1) | psc.devices[device].direction) << 1 )| psc.devices[device].enabled;
+  psc.devices[device].delay = max(delay, psc.devices[device].min_delay);
+  picostepper_set_command(device, picostepper_encode_command(psc.devices[device].delay, psc.devices[device].direction, psc.devices[device].enabled));
 }
 
 void picostepper_set_async_speed(PicoStepper device, uint speed){
@@ -265,6 +430,16 @@ void picostepper_set_acceleration(PicoStepper device, uint acceleration){
 // Set the steppers internal position value
 void picostepper_set_position(PicoStepper device, uint position){
   psc.devices[device].position = position;
+  psc.devices[device].step_position = position;
+  psc.devices[device].slice_steps = 0;
+  psc.devices[device].queued_steps = 0;
+  // The encoder reads the same position from now on
+  if(psc.devices[device].encoder_is_configured) {
+    psc.devices[device].encoder_offset = picostepper_encoder_read(device);
+    psc.devices[device].encoder_origin = position;
+    psc.devices[device].pending_correction = 0;
+    psc.devices[device].is_stalled = false;
+  }
 }
 
 // Set the steppers internal position value
@@ -298,9 +473,26 @@ bool picostepper_move_async(PicoStepper device, int steps, PicoStepperCallback f
     return false;
   }
 
+  psc.devices[device].steps = steps;
+  return picostepper_move_slice(device, steps, func);
+}
+
+// Stream the steps of picostepper_move_async, a shaped slice is streamed in parts that are shaped one after another
+static bool picostepper_move_slice(PicoStepper device, int steps, PicoStepperCallback func) {
+
   if(psc.devices[device].delay == 0) psc.devices[device].delay = picostepper_convert_speed_to_delay(psc.devices[device].min_speed);
 
+  uint part_steps = picostepper_shaper_slice_steps(device, steps);
+  psc.devices[device].shaper.remaining_steps = steps - part_steps;
+  psc.devices[device].shaper.callback = func;
+  if(part_steps < steps) func = &picostepper_shaper_continue;
+  steps = part_steps;
+
   psc.devices[device].callback = func;
+
+  // Track the steps of this slice for the step counted position, no steps are taken while disabled
+  // The direction is taken from the command, as the input shaper may step in a different direction than commanded
+  picostepper_track_slice(device, steps, psc.devices[device].enabled ? picostepper_command_direction(psc.devices[device].command, psc.devices[device].polarity) : 0);
     
   if(psc.devices[device].pio_id == 0) {
     dma_channel_configure(
@@ -321,6 +513,7 @@ bool picostepper_move_async(PicoStepper device, int steps, PicoStepperCallback f
         false             // Don't start yet
     );
   }
+  picostepper_trace_record(device, steps, psc.devices[device].command);
   // Set read address for the dma (switching between two buffers has not been implemented) and start transmission
   dma_channel_set_read_addr(psc.devices[device].dma_channel, &psc.devices[device].command, true);
   psc.devices[device].is_running = true;
@@ -328,6 +521,209 @@ bool picostepper_move_async(PicoStepper device, int steps, PicoStepperCallback f
   return true;
 }
 
+// Start a new velocity profile for the input shaper
+static void picostepper_shaper_reset(PicoStepper device){
+  psc.devices[device].shaper.time = 0;
+  psc.devices[device].shaper.speed = 0;
+  psc.devices[device].shaper.is_settled = true;
+  psc.devices[device].shaper.history_head = 0;
+  psc.devices[device].shaper.history_count = 0;
+}
+
+// Record the signed commanded velocity of the next slice and convolve the velocity profile with the impulses of the shaper
+// Only changes of the velocity are recorded, the stepper is at rest before the first one
+// Runs in the DMA interrupt for every part of a slice, see picostepper_measure_shaper_cost
+static int picostepper_shaper_apply(PicoStepperShaper *shaper, int velocity){
+  int previous_velocity = shaper->history_count > 0 ? shaper->history_velocity[shaper->history_head] : 0;
+  if(velocity != previous_velocity) {
+    shaper->history_head = shaper->history_head + 1 < SHAPER_HISTORY ? shaper->history_head + 1 : 0;
+    shaper->history_time[shaper->history_head] = shaper->time;
+    shaper->history_velocity[shaper->history_head] = velocity;
+    shaper->history_count = min(shaper->history_count + 1, SHAPER_HISTORY);
+  }
+
+  // Once the last change is older than the duration of the shaper, the slice runs at the commanded velocity
+  // The history then collapses into that change, which also keeps its age from wrapping around
+  uint32_t duration = shaper->times[shaper->impulses - 1];
+  shaper->is_settled = shaper->history_count == 0 || shaper->time - shaper->history_time[shaper->history_head] >= duration;
+  if(shaper->is_settled) {
+    if(shaper->history_count > 0) shaper->history_time[shaper->history_head] = shaper->time - duration;
+    shaper->history_count = min(shaper->history_count, 1);
+    return velocity;
+  }
+
+  // Before the movement started the stepper was at rest, unless the history has already been overwritten
+  uint oldest = shaper->history_head + 1 < SHAPER_HISTORY ? shaper->history_head + 1 : 0;
+  int initial_velocity = shaper->history_count == SHAPER_HISTORY ? shaper->history_velocity[oldest] : 0;
+
+  // The impulses are sorted by their delay, so one scan from the last change backwards finds the velocities of all of them
+  int64_t shaped_velocity = 0;
+  uint index = shaper->history_head;
+  uint count = 0;
+  for (size_t i = 0; i < shaper->impulses; i++)
+  {
+    while(count < shaper->history_count && shaper->time - shaper->history_time[index] < shaper->times[i]) {
+      index = index > 0 ? index - 1 : SHAPER_HISTORY - 1;
+      count++;
+    }
+    int impulse_velocity = count < shaper->history_count ? shaper->history_velocity[index] : initial_velocity;
+    shaped_velocity += (int64_t) shaper->amplitudes[i] * impulse_velocity;
+  }
+  return (int) (shaped_velocity / 65536);
+}
+
+// Check whether the current slice runs at the commanded velocity, as it has not changed for the duration of the shaper
+static bool picostepper_shaper_is_settled(PicoStepperShaper *shaper){
+  return shaper->type == NoShaper || shaper->is_settled;
+}
+
+// Get the steps of the next part of a slice of a device
+// A shaped slice is split so each part lasts at most 1/SHAPER_SLICE_FRACTION of the spacing of the impulses at its
+// shaped speed, then the shaped velocity follows the impulses closely. Settled slices keep running at their velocity.
+static uint picostepper_shaper_slice_steps(PicoStepper device, uint steps){
+  PicoStepperShaper *shaper = &psc.devices[device].shaper;
+  if(shaper->type == NoShaper || shaper->speed == 0 || shaper->is_settled) return steps;
+
+  uint32_t spacing = shaper->times[1] - shaper->times[0];
+  uint64_t part_steps = ((uint64_t) shaper->speed * spacing) / ((uint64_t) SHAPER_SLICE_FRACTION * 1000000);
+  return (uint) min((uint64_t) steps, max(part_steps, (uint64_t) 1));
+}
+
+// Get the steps a movement ending at speed keeps for the shaped velocity to settle, for a shaper of duration (us)
+// While these steps are streamed the shaped speed stays below the speed the profile had twice that duration before its end
+static uint picostepper_shaper_tail_steps(uint speed, uint acceleration, uint duration){
+  if(duration == 0) return 0;
+  uint64_t bound = speed + ((uint64_t) acceleration * 2 * duration) / 1000000;
+  return (uint) ((bound * duration + 999999) / 1000000);
+}
+
+// Stream the next part of a split slice, shaped at the current profile time
+// The shaped direction may change between parts, the tracked position follows it for the remaining steps
+static void picostepper_shaper_continue(PicoStepper device){
+  int direction = picostepper_command_direction(psc.devices[device].command, psc.devices[device].polarity);
+  picostepper_set_profile_delay(device, psc.devices[device].delay);
+  int shaped_direction = picostepper_command_direction(psc.devices[device].command, psc.devices[device].polarity);
+  psc.devices[device].position += (shaped_direction - direction) * (int) psc.devices[device].shaper.remaining_steps;
+  picostepper_move_slice(device, psc.devices[device].shaper.remaining_steps, psc.devices[device].shaper.callback);
+}
+
+// Set the delay of the velocity profile, the command of the device uses the delay after input shaping
+// The shaped velocity lags behind the profile, so after a reversal the stepper may keep its old direction for a while
+static void picostepper_set_profile_delay(PicoStepper device, uint delay){
+  picostepper_set_async_delay(device, delay);
+  if(psc.devices[device].shaper.type == NoShaper) {
+    return;
+  }
+
+  uint speed = picostepper_convert_delay_to_speed(psc.devices[device].delay);
+  bool direction = psc.devices[device].direction ^ psc.devices[device].polarity;
+  int velocity = picostepper_shaper_apply(&psc.devices[device].shaper, direction ? (int) speed : -(int) speed);
+
+  // Crossing zero, the stepper runs at the lowest speed it can start and stop at
+  if(velocity != 0) direction = velocity > 0;
+  uint shaped_speed = max((uint) abs(velocity), max(min(psc.devices[device].min_speed, speed), 1));
+
+  uint shaped_delay = max(picostepper_convert_speed_to_delay(shaped_speed), psc.devices[device].min_delay);
+  picostepper_set_command(device, picostepper_encode_command(shaped_delay, direction ^ psc.devices[device].polarity, psc.devices[device].enabled));
+  // The profile time advances by the duration of the steps at the shaped speed
+  psc.devices[device].shaper.speed = max(picostepper_convert_delay_to_speed(shaped_delay), 1);
+}
+
+// Configure the input shaper applied to the velocity profile of accelerated movements to suppress ringing
+// frequency is the resonance frequency (Hz) of the axis and damping its damping ratio (0 <= damping < 1)
+bool picostepper_set_input_shaper(PicoStepper device, PicoStepperShaperType type, float frequency, float damping){
+  // Error: Invalid resonance parameters
+  if(type != NoShaper && (frequency <= 0 || damping < 0 || damping >= 1)) {
+    return false;
+  }
+
+  double amplitudes[SHAPER_MAX_IMPULSES];
+  double times[SHAPER_MAX_IMPULSES];
+  uint impulses = 0;
+
+  double damped = sqrt(1.0 - (double) damping * damping);
+  double k = exp(-(double) damping * M_PI / damped);
+  double half_period = 0.5 / ((double) frequency * damped);
+  // Vibration tolerance of the EI shaper
+  double tolerance = 0.05;
+
+  switch(type){
+    case NoShaper:
+      break;
+
+    case ZVShaper:
+      impulses = 2;
+      amplitudes[0] = 1; amplitudes[1] = k;
+      times[0] = 0; times[1] = half_period;
+      break;
+
+    case ZVDShaper:
+      impulses = 3;
+      amplitudes[0] = 1; amplitudes[1] = 2 * k; amplitudes[2] = k * k;
+      times[0] = 0; times[1] = half_period; times[2] = 2 * half_period;
+      break;
+
+    case EIShaper:
+      impulses = 3;
+      amplitudes[0] = 0.25 * (1 + tolerance); amplitudes[1] = 0.5 * (1 - tolerance) * k; amplitudes[2] = 0.25 * (1 + tolerance) * k * k;
+      times[0] = 0; times[1] = half_period; times[2] = 2 * half_period;
+      break;
+
+    default:  return false;
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < impulses; i++) sum += amplitudes[i];
+
+  psc.devices[device].shaper.type = type;
+  psc.devices[device].shaper.impulses = impulses;
+  for (size_t i = 0; i < impulses; i++)
+  {
+    psc.devices[device].shaper.amplitudes[i] = (uint32_t) (amplitudes[i] / sum * 65536.0 + 0.5);
+    psc.devices[device].shaper.times[i] = (uint32_t) (times[i] * 1000000.0 + 0.5);
+  }
+  picostepper_shaper_reset(device);
+  return true;
+}
+
+// Get the duration (us) of the input shaper of a device, the time its shaped velocity lags behind the commanded one
+uint picostepper_get_shaper_duration(PicoStepper device){
+  if(psc.devices[device].shaper.type == NoShaper) return 0;
+  return psc.devices[device].shaper.times[psc.devices[device].shaper.impulses - 1];
+}
+
+// Measure the time (ns) the DMA interrupt takes to shape a part of a slice of a device in the worst case, with a history
+// full of velocity changes that are all younger than the duration of the shaper, so every impulse scans all of them
+// The PIO steps the commands queued in its TX FIFO meanwhile, which limits the step rate of a shaped stepper
+// Only measures a device at rest, its state is restored afterwards
+uint picostepper_measure_shaper_cost(PicoStepper device){
+  // Error: No input shaper configured or device is running
+  if(psc.devices[device].shaper.type == NoShaper || psc.devices[device].is_running || psc.devices[device].velocity_mode) {
+    return 0;
+  }
+  PicoStepperRawDevice saved = psc.devices[device];
+  PicoStepperShaper *shaper = &psc.devices[device].shaper;
+  uint32_t interval = max(shaper->times[shaper->impulses - 1] / (2 * SHAPER_HISTORY), 1);
+  uint delay = picostepper_convert_speed_to_delay(psc.devices[device].min_speed);
+
+  picostepper_shaper_reset(device);
+  uint32_t interrupts = save_and_disable_interrupts();
+  uint32_t start = 0;
+  for (size_t i = 0; i < SHAPER_HISTORY + SHAPER_COST_RUNS; i++)
+  {
+    if(i == SHAPER_HISTORY) start = time_us_32();
+    // Reversing on every part records a change every time
+    psc.devices[device].direction = i % 2;
+    shaper->time += interval;
+    picostepper_set_profile_delay(device, delay);
+  }
+  uint32_t elapsed = time_us_32() - start;
+  restore_interrupts(interrupts);
+
+  psc.devices[device] = saved;
+  return (uint) (((uint64_t) elapsed * 1000) / SHAPER_COST_RUNS);
+}
+
 // Handle stepper acceleration as an async callback
 void picostepper_accelerate(volatile PicoStepper device){
   // Base case, if direction is 0 we are coasting, do nothing
@@ -338,12 +734,14 @@ void picostepper_accelerate(volatile PicoStepper device){
   // If direction is negative, we are decelerating
   if(psc.devices[device].acceleration_direction < 0){
 
-    // Pop the new delay value off the speed stack
-    uint delay = psc.devices[device].coasting_slices-- > 0 ? psc.devices[device].delay : pop(&psc.devices[device].stack);
+    // Pop the new delay value off the speed stack, once the slices at maximum speed have been undone
+    uint delay = psc.devices[device].delay;
+    if(psc.devices[device].coasting_slices > 0) psc.devices[device].coasting_slices--;
+    else if(!isEmpty(&psc.devices[device].stack)) delay = pop(&psc.devices[device].stack);
 
     //printf("Decelerating to %d\n", delay);
 
-    picostepper_set_async_delay(device, delay);
+    picostepper_set_profile_delay(device, delay);
     return;
   }
 
@@ -357,15 +755,15 @@ void picostepper_accelerate(volatile PicoStepper device){
     // Calculate the current speed based on the delay
     uint speed = picostepper_convert_delay_to_speed(delay);
 
-    // Determine how many steps per second to increase speed based on acceleration and current speed
-    double time_s = (double) NUMSTEPS/ (double) speed;
+    // Determine how many steps per second to increase speed based on acceleration and the duration of the last slice
+    double time_s = (double) psc.devices[device].steps/ (double) speed;
     speed += (uint) ((double) psc.devices[device].moving_acceleration)*time_s;
 
     // If the delay is too small to make a change, decrease delay by 1. If we are already at the minimum delay (maximum speed), keep it there
     uint calculated_delay = picostepper_convert_speed_to_delay(speed);
     calculated_delay = calculated_delay == delay ? delay - 1 : calculated_delay;
 
-    uint min_delay = picostepper_convert_speed_to_delay(psc.devices[device].max_speed);
+    uint min_delay = picostepper_convert_speed_to_delay(psc.devices[device].moving_max_speed);
     delay = max(calculated_delay, min_delay);
 
     if(delay == min_delay){
@@ -376,11 +774,289 @@ void picostepper_accelerate(volatile PicoStepper device){
       //printf("Init at %d Accelerating to %d\n", init_delay, delay);
     }
 
-    picostepper_set_async_delay(device, delay);
+    picostepper_set_profile_delay(device, delay);
     return;
   }
 }
 
+// Calculate the speed of the next slice when ramping from speed towards goal under the given acceleration
+static uint picostepper_velocity_ramp(uint speed, uint goal, uint acceleration){
+  if(acceleration == 0) return goal;
+
+  // Speed reached after NUMSTEPS steps of constant acceleration: v^2 = v0^2 + 2*a*s
+  double ramp = 2.0 * (double) acceleration * (double) NUMSTEPS;
+  double squared_speed = (double) speed * (double) speed;
+
+  if(speed < goal) return min((uint) sqrt(squared_speed + ramp), goal);
+  if(speed > goal) return max((uint) sqrt(max(squared_speed - ramp, 0.0)), goal);
+  return speed;
+}
+
+// Stream the next slice of a continuous velocity movement, ramping towards the target velocity
+// Invoked as the callback of each slice, the next slice is armed while the PIO still drains its FIFO, so no gaps occur
+static void picostepper_velocity_update(PicoStepper device){
+  int target = psc.devices[device].target_velocity;
+  int velocity = psc.devices[device].velocity;
+  uint speed = abs(velocity);
+  // Below this speed the stepper can start, stop and reverse without ramping
+  uint floor_speed = max(psc.devices[device].min_speed, 1);
+
+  // Ramp down to rest before stopping or reversing
+  bool reversing = velocity != 0 && (target == 0 || (target > 0) != (velocity > 0));
+  if((reversing || velocity == 0) && speed <= floor_speed){
+    // The shaped velocity lags behind, keep running until it has caught up before stopping
+    if(target == 0 && (velocity == 0 || picostepper_shaper_is_settled(&psc.devices[device].shaper))){
+      psc.devices[device].velocity = 0;
+      // Make up for lost steps before stopping, this is invoked again at rest afterwards
+      if(picostepper_apply_correction(device, &picostepper_velocity_update)) {
+        return;
+      }
+      psc.devices[device].velocity_mode = false;
+      if(psc.devices[device].velocity_callback != NULL) {
+        (*psc.devices[device].velocity_callback)(device);
+      }
+      return;
+    }
+    // Start again from rest in the direction of the target
+    if(target != 0){
+      velocity = 0;
+      speed = 0;
+      reversing = false;
+    }
+  }
+
+  uint goal = 0;
+  if(!reversing){
+    goal = abs(target);
+    if(psc.devices[device].max_speed > 0) goal = min(goal, psc.devices[device].max_speed);
+  }
+  if(velocity == 0){
+    // Starting from rest the stepper jumps to the floor speed, or right to a lower target
+    speed = min(floor_speed, goal);
+  } else {
+    speed = picostepper_velocity_ramp(speed, goal, psc.devices[device].acceleration);
+    // Ramping down to rest, the stepper stops or reverses from the floor speed
+    if(reversing) speed = max(speed, min(floor_speed, (uint) abs(velocity)));
+  }
+
+  bool direction = reversing ? velocity > 0 : target > 0;
+  psc.devices[device].velocity = direction ? (int) speed : -(int) speed;
+
+  picostepper_set_async_direction(device, direction);
+  picostepper_set_profile_delay(device, picostepper_convert_speed_to_delay(speed));
+  // Account for the slice in the direction it is actually stepped in
+  psc.devices[device].position += picostepper_command_direction(psc.devices[device].command, psc.devices[device].polarity) * NUMSTEPS;
+  picostepper_move_async(device, NUMSTEPS, &picostepper_velocity_update);
+}
+
+// Set the signed velocity (steps/second) to continuously run the stepper at
+// Ramps to the new velocity using the configured acceleration, through zero if the direction is reversed
+// A velocity of 0 ramps the stepper down to rest, at which point func is invoked (may be NULL)
+bool picostepper_set_velocity(PicoStepper device, int velocity, PicoStepperCallback func){
+  // Error: No valid PicoStepper device
+  if(device == -1 || !psc.devices[device].is_configured) {
+    return false;
+  }
+
+  bool result = true;
+  // The slice callback must not observe a half updated state
+  uint32_t interrupts = save_and_disable_interrupts();
+
+  psc.devices[device].target_velocity = velocity;
+  psc.devices[device].velocity_callback = func;
+
+  if(!psc.devices[device].velocity_mode){
+    // Error: Device is already running a movement of a fixed number of steps
+    if(psc.devices[device].is_running) {
+      result = false;
+    } else {
+      psc.devices[device].velocity_mode = true;
+      psc.devices[device].velocity = 0;
+      picostepper_shaper_reset(device);
+      picostepper_velocity_update(device);
+    }
+  }
+
+  restore_interrupts(interrupts);
+  return result;
+}
+
+// Get the signed velocity (steps/second) the stepper is currently running at in velocity mode
+int picostepper_get_velocity(PicoStepper device){
+  return psc.devices[device].velocity;
+}
+
+// Read the raw count of the quadrature encoder paired with a device
+static int picostepper_encoder_read(PicoStepper device){
+  PIO pio = psc.devices[device].encoder_pio;
+  uint sm = psc.devices[device].encoder_statemachine;
+  int count = 0;
+  // The encoder program pushes its count continuously, drain the FIFO to get the most recent one
+  uint32_t interrupts = save_and_disable_interrupts();
+  uint n = pio_sm_get_rx_fifo_level(pio, sm) + 1;
+  while (n-- > 0) count = (int) pio_sm_get_blocking(pio, sm);
+  restore_interrupts(interrupts);
+  return count;
+}
+
+// Check the following error of all steppers with an encoder while they are moving and report stalls
+static bool picostepper_encoder_monitor(repeating_timer_t *rt){
+  for (size_t i = 0; i < psc.max_device_count; i++)
+  {
+    PicoStepper device = (PicoStepper) i;
+    if(!psc.device_with_index_is_in_use[i] || !psc.devices[device].encoder_is_configured) {
+      continue;
+    }
+    if(psc.devices[device].stall_threshold == 0 || psc.devices[device].is_stalled) {
+      continue;
+    }
+    if(!psc.devices[device].is_running && !psc.devices[device].velocity_mode) {
+      continue;
+    }
+    if(abs(picostepper_get_following_error(device)) > psc.devices[device].stall_threshold) {
+      psc.devices[device].is_stalled = true;
+      if(psc.devices[device].stall_callback != NULL) {
+        (*psc.devices[device].stall_callback)(device);
+      }
+    }
+  }
+  return true;
+}
+
+// Pair a quadrature encoder (A on base_pin, B on base_pin + 1) with a device
+// counts encoder counts correspond to steps steps of the stepper, a negative counts value inverts the encoder
+// The encoder program has to be placed at the start of a PIO block, so it needs a PIO block without driver programs
+bool picostepper_encoder_init(PicoStepper device, uint base_pin, int counts, int steps) {
+  // Error: No valid PicoStepper device
+  if(device == -1 || !psc.devices[device].is_configured) {
+    return false;
+  }
+  // Error: No valid ratio between encoder counts and steps
+  if(counts == 0 || steps <= 0) {
+    return false;
+  }
+  // Prefer pio1 as the drivers are placed on pio0 first
+  int pio_ids[2] = {1, 0};
+  for (size_t i = 0; i < 2; i++)
+  {
+    int pio_id = pio_ids[i];
+    PIO pio_block = pio_id == 0 ? pio0 : pio1;
+    if(!psc.encoder_program_is_loaded[pio_id] && !pio_can_add_program_at_offset(pio_block, &picostepper_quadrature_encoder_program, 0)) {
+      continue;
+    }
+    int statemachine = pio_claim_unused_sm(pio_block, false);
+    if(statemachine == -1) {
+      continue;
+    }
+    // The program is shared by all encoders on a PIO block
+    if(!psc.encoder_program_is_loaded[pio_id]) {
+      pio_add_program_at_offset(pio_block, &picostepper_quadrature_encoder_program, 0);
+      psc.encoder_program_is_loaded[pio_id] = true;
+    }
+    picostepper_quadrature_encoder_program_init(pio_block, statemachine, 0, base_pin);
+
+    psc.devices[device].encoder_pio = pio_block;
+    psc.devices[device].encoder_statemachine = statemachine;
+    psc.devices[device].encoder_counts = counts;
+    psc.devices[device].encoder_steps = steps;
+    psc.devices[device].encoder_offset = picostepper_encoder_read(device);
+    psc.devices[device].encoder_origin = picostepper_get_step_position(device);
+    psc.devices[device].pending_correction = 0;
+    psc.devices[device].is_stalled = false;
+    psc.devices[device].encoder_is_configured = true;
+
+    if(!psc.encoder_timer_is_running) {
+      add_repeating_timer_ms(-ENCODER_POLL_MS, picostepper_encoder_monitor, NULL, &psc.encoder_timer);
+      psc.encoder_timer_is_running = true;
+    }
+    return true;
+  }
+  // Error: No free resources to use for the encoder
+  return false;
+}
+
+// Get the raw count of the encoder paired with a device
+int picostepper_get_encoder_count(PicoStepper device){
+  if(!psc.devices[device].encoder_is_configured) return 0;
+  return picostepper_encoder_read(device) - psc.devices[device].encoder_offset;
+}
+
+// Get the position measured by the encoder, converted into steps
+int picostepper_get_encoder_position(PicoStepper device){
+  if(!psc.devices[device].encoder_is_configured) return picostepper_get_step_position(device);
+  int64_t count = picostepper_get_encoder_count(device);
+  return psc.devices[device].encoder_origin + (int) ((count * psc.devices[device].encoder_steps) / psc.devices[device].encoder_counts);
+}
+
+// Get the position based on the steps taken so far, including a running movement
+int picostepper_get_step_position(PicoStepper device){
+  uint32_t interrupts = save_and_disable_interrupts();
+  // Steps still waiting in the DMA or in the TX FIFO of the statemachine, the queued steps of previous slices come first
+  uint pending = pio_sm_get_tx_fifo_level(psc.devices[device].pio, psc.devices[device].statemachine);
+  pending += dma_hw->ch[psc.devices[device].dma_channel].transfer_count;
+  uint taken = psc.devices[device].slice_steps - min(pending, psc.devices[device].slice_steps);
+  uint queued_pending = min(pending - min(pending, psc.devices[device].slice_steps), psc.devices[device].queued_steps);
+  int position = psc.devices[device].step_position + psc.devices[device].slice_direction * (int) taken;
+  position += psc.devices[device].queued_direction * (int) (psc.devices[device].queued_steps - queued_pending);
+  restore_interrupts(interrupts);
+  return position;
+}
+
+// Get the difference between the measured and the step counted position (negative if the stepper lags behind)
+int picostepper_get_following_error(PicoStepper device){
+  if(!psc.devices[device].encoder_is_configured) return 0;
+  return picostepper_get_encoder_position(device) - picostepper_get_step_position(device);
+}
+
+// Set the following error (in steps) above which a moving stepper is considered stalled, 0 disables stall detection
+// func is invoked once when the stall is detected, until the error is corrected
+void picostepper_set_stall_threshold(PicoStepper device, uint threshold, PicoStepperCallback func){
+  psc.devices[device].stall_threshold = threshold;
+  psc.devices[device].stall_callback = func;
+}
+
+bool picostepper_is_stalled(PicoStepper device){
+  return psc.devices[device].is_stalled;
+}
+
+// Move a device at rest by the steps remembered by picostepper_correct_following_error, invoking func once they are streamed
+// Returns false if no correction was pending
+static bool picostepper_apply_correction(PicoStepper device, PicoStepperCallback func){
+  uint32_t interrupts = save_and_disable_interrupts();
+  int correction = psc.devices[device].pending_correction;
+  psc.devices[device].pending_correction = 0;
+  restore_interrupts(interrupts);
+
+  if(correction == 0) {
+    return false;
+  }
+  picostepper_set_async_direction(device, correction > 0);
+  return picostepper_move_async(device, abs(correction), func);
+}
+
+// Correct the following error of a device
+// While moving, the measured position is accepted as the step counted position and the lost steps are remembered,
+// the movement makes up for them once it has ended. At rest, the stepper is moved by the lost steps right away.
+bool picostepper_correct_following_error(PicoStepper device){
+  // Error: No encoder paired with the device
+  if(!psc.devices[device].encoder_is_configured) {
+    return false;
+  }
+  int error = picostepper_get_following_error(device);
+
+  uint32_t interrupts = save_and_disable_interrupts();
+  psc.devices[device].step_position += error;
+  psc.devices[device].pending_correction -= error;
+  psc.devices[device].is_stalled = false;
+  bool is_moving = psc.devices[device].is_running || psc.devices[device].velocity_mode;
+  restore_interrupts(interrupts);
+
+  if(is_moving || psc.devices[device].pending_correction == 0) {
+    return true;
+  }
+  return picostepper_apply_correction(device, NULL);
+}
+
 // Take a number of steps as a position value and move to it applying acceleration as needed
 bool picostepper_move_to_position(volatile PicoStepper device, int position){
 
@@ -394,8 +1070,16 @@ bool picostepper_move_to_position(volatile PicoStepper device, int position){
   psc.devices[device].delay = picostepper_convert_speed_to_delay(psc.devices[device].min_speed);
   psc.devices[device].coasting_slices = 0;
   psc.devices[device].moving_acceleration = psc.devices[device].acceleration;
+  psc.devices[device].moving_max_speed = psc.devices[device].max_speed;
 
   picostepper_set_async_direction(device, direction);
+  picostepper_shaper_reset(device);
+  picostepper_set_profile_delay(device, psc.devices[device].delay);
+
+  // Keep steps to run at the stop speed at the end, until the shaped velocity has settled on it
+  uint stop_delay = psc.devices[device].delay;
+  uint tail_steps = min(picostepper_shaper_tail_steps(picostepper_convert_delay_to_speed(stop_delay), psc.devices[device].moving_acceleration, picostepper_get_shaper_duration(device)), steps);
+  steps -= tail_steps;
 
   // Split the movement into even slices for accelerating and decelerating
   uint acceleration_steps = steps/NUMSTEPS;
@@ -409,24 +1093,47 @@ bool picostepper_move_to_position(volatile PicoStepper device, int position){
 
   // Consume any extra steps that prevent an even split, coast at current speed rather than changing it
   psc.devices[device].acceleration_direction = 0;
-  if(steps%NUMSTEPS > 0){
-    picostepper_move_async(device, steps%NUMSTEPS, NULL);
+  uint coasting_steps = steps - acceleration_steps/2 * 2 * NUMSTEPS;
+  if(coasting_steps > 0){
+    picostepper_move_async(device, coasting_steps, NULL);
     while(psc.devices[device].is_running) sleep_us(10);
   }
 
-  // Decelerate in the same fashion as accelerating
+  // Decelerate in the same fashion as accelerating, starting at the speed of the last accelerating slice
   psc.devices[device].acceleration_direction = -1;
+  if(acceleration_steps/2 > 0) picostepper_accelerate(device);
   for(uint i=0; i<acceleration_steps/2; i++){
     picostepper_move_async(device, NUMSTEPS, &picostepper_accelerate);
     while(psc.devices[device].is_running) sleep_us(10);
   }
 
+  // Run the remaining steps at the stop speed, so the movement ends at it
+  // They are streamed in short parts until the shaped velocity has settled, the rest follows at once
+  psc.devices[device].acceleration_direction = 0;
+  if(tail_steps > 0){
+    picostepper_set_profile_delay(device, stop_delay);
+    picostepper_move_async(device, tail_steps, NULL);
+    while(psc.devices[device].is_running) sleep_us(10);
+  }
+
+  // Make up for the steps lost while moving
+  if(picostepper_apply_correction(device, NULL)) {
+    while(psc.devices[device].is_running) sleep_us(10);
+  }
+
   return true;
 }
 
 // Take a number of steps as a position value and move to it applying acceleration as needed for multiple steppers
-// All the loops feel a bit redundant, might want to try and look into consolidating them better
 bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions[], uint num_steppers, bool sequential){
+  return picostepper_move_to_positions_at(devices, positions, NULL, num_steppers, sequential);
+}
+
+// Like picostepper_move_to_positions, but every stepper runs at most at the given speed (steps/second) for this movement
+// instead of its maximum speed. Without NULL, steppers that accelerate start at proportionally reduced speeds
+// so they stay in sync, movements too short to accelerate run at the given speeds right away.
+// All the loops feel a bit redundant, might want to try and look into consolidating them better
+bool picostepper_move_to_positions_at(volatile PicoStepper devices[], int positions[], uint speeds[], uint num_steppers, bool sequential){
 
   // Setup trackers for the various steppers
   bool stepper_directions[num_steppers];
@@ -437,7 +1144,7 @@ bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions
   uint most_steps = 0;
   bool no_move_needed = true;
 
-  for(uint stepper; stepper < num_steppers; stepper++) no_move_needed &= positions[stepper] == psc.devices[devices[stepper]].position;
+  for(uint stepper = 0; stepper < num_steppers; stepper++) no_move_needed &= positions[stepper] == psc.devices[devices[stepper]].position;
   if(no_move_needed) return true;
 
   //bool sequential = abs(steppers[0] - steppers[1]) <= NUMSTEPS;
@@ -445,7 +1152,7 @@ bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions
   //printf("Need to move\n");
 
   // Determine what each stepper should do
-  for(uint stepper; stepper < num_steppers; stepper++){
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
 
     // Determine the number of steps to be taken, and in which direction
     uint current_position = psc.devices[devices[stepper]].position;
@@ -459,6 +1166,8 @@ bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions
     // Update the tracked position value and direction
     psc.devices[devices[stepper]].position = positions[stepper];
     picostepper_set_async_direction(devices[stepper], direction);
+    picostepper_shaper_reset(devices[stepper]);
+    psc.devices[devices[stepper]].coasting_slices = 0;
 
     // Determine which motor has the least distance to travel to set the number of slices
     steps = steps == 0 ? steps_to_take : min(steps, steps_to_take);
@@ -472,10 +1181,58 @@ bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions
   // Split the movement into even slices for accelerating and decelerating
   //uint acceleration_steps = steps/NUMSTEPS;
   uint acceleration_steps = most_steps/NUMSTEPS;
-  if (psc.devices[devices[0]].acceleration == 0 || psc.devices[devices[1]].acceleration == 0){
+  if (acceleration == 0){
     acceleration_steps = 0;
   }
 
+  // Scale the start speeds so the fastest stepper starts at its minimum speed, unless no slices to accelerate in remain
+  double start_factor = 1.0;
+  if(speeds != NULL && acceleration_steps/2 > 0){
+    for(uint stepper = 0; stepper < num_steppers; stepper++){
+      if(speeds[stepper] > 0) start_factor = min(start_factor, (double) max(psc.devices[devices[stepper]].min_speed, 1) / (double) speeds[stepper]);
+    }
+  }
+
+  // Set the speed each stepper starts at and the speed it may accelerate to
+  uint previous_delays[num_steppers];
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    PicoStepper device = devices[stepper];
+    previous_delays[stepper] = psc.devices[device].delay;
+    psc.devices[device].moving_max_speed = psc.devices[device].max_speed;
+    if(speeds != NULL){
+      psc.devices[device].moving_max_speed = max(speeds[stepper], 1);
+      picostepper_set_async_speed(device, max((uint) (speeds[stepper] * start_factor), 1));
+    }
+    picostepper_set_profile_delay(device, psc.devices[device].delay);
+  }
+
+  // Keep steps to run at the start speeds at the end, until the shaped velocities have settled on them
+  // All steppers keep them for the longest shaper, so they stay in sync. Movements that could not accelerate anymore keep none.
+  uint shaper_duration = 0;
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    shaper_duration = max(shaper_duration, picostepper_get_shaper_duration(devices[stepper]));
+  }
+  uint stop_delays[num_steppers];
+  uint tail_steps[num_steppers];
+  uint remaining_steps = 0;
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    stop_delays[stepper] = psc.devices[devices[stepper]].delay;
+    uint stepper_acceleration = (uint) (((uint64_t) acceleration * stepper_steps[stepper]) / most_steps);
+    tail_steps[stepper] = acceleration_steps/2 > 0 ? picostepper_shaper_tail_steps(picostepper_convert_delay_to_speed(stop_delays[stepper]), stepper_acceleration, shaper_duration) : 0;
+    tail_steps[stepper] = min(tail_steps[stepper], stepper_steps[stepper]);
+    remaining_steps = max(remaining_steps, stepper_steps[stepper] - tail_steps[stepper]);
+  }
+  if(remaining_steps/NUMSTEPS/2 == 0){
+    for(uint stepper = 0; stepper < num_steppers; stepper++) tail_steps[stepper] = 0;
+  }
+  most_steps = 0;
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    stepper_steps[stepper] -= tail_steps[stepper];
+    step_differences[stepper] -= tail_steps[stepper];
+    most_steps = max(most_steps, stepper_steps[stepper]);
+  }
+  if(acceleration != 0) acceleration_steps = most_steps/NUMSTEPS;
+
   //printf("Acceleration steps: %d\n", acceleration_steps);
 
   // Set each steppers acceleration direction and acceleration rate
@@ -497,14 +1254,17 @@ bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions
 
   //printf("Steps per slice calculated\n");
 
+  // Steppers with too few steps per slice skip accelerating, unless they have to stay in sync at the given speeds
+  uint min_slice_steps = speeds != NULL ? 0 : MINSTEPS;
+
   // Accelerate for the first half of the slices
   for(int i=0; i<acceleration_steps/2; i++){
     for(int stepper = 0; stepper < num_steppers; stepper++){
       //printf("Stepper %d taking %d steps with acceleration %d\n", stepper, stepper_steps[stepper], psc.devices[devices[stepper]].moving_acceleration);
-      if(stepper_steps[stepper] > MINSTEPS){
+      if(stepper_steps[stepper] > min_slice_steps){
         picostepper_move_async(devices[stepper], stepper_steps[stepper], &picostepper_accelerate);
         step_differences[stepper] -= stepper_steps[stepper]*2;
-      } else step_differences[stepper] += stepper_steps[stepper]*2;
+      }
 
       if(sequential) while(psc.devices[devices[stepper]].is_running);
     }
@@ -540,15 +1300,16 @@ bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions
 
   //printf("Done coasting\n");
 
-  // Set acceleration direction to decelerate
+  // Set acceleration direction to decelerate, starting at the speed of the last accelerating slice
   for(int stepper = 0; stepper < num_steppers; stepper++){
     psc.devices[devices[stepper]].acceleration_direction = -1;
+    if(acceleration_steps/2 > 0 && stepper_steps[stepper] > min_slice_steps) picostepper_accelerate(devices[stepper]);
   }
 
   // Begin decelerating
   for(int i=0; i<acceleration_steps/2; i++){
     for(int stepper = 0; stepper < num_steppers; stepper++){
-      if(stepper_steps[stepper] > MINSTEPS) picostepper_move_async(devices[stepper], stepper_steps[stepper], &picostepper_accelerate);
+      if(stepper_steps[stepper] > min_slice_steps) picostepper_move_async(devices[stepper], stepper_steps[stepper], &picostepper_accelerate);
       if(sequential) while(psc.devices[devices[stepper]].is_running);
     }
     if(!sequential){
@@ -563,5 +1324,110 @@ bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions
 
   //printf("Done decelerating\n");
 
+  // Run the remaining steps at the start speeds, so the movement ends at them
+  // They are streamed in short parts until the shaped velocities have settled, the rest follows at once
+  for(int stepper = 0; stepper < num_steppers; stepper++){
+    psc.devices[devices[stepper]].acceleration_direction = 0;
+    if(tail_steps[stepper] > 0){
+      picostepper_set_profile_delay(devices[stepper], stop_delays[stepper]);
+      picostepper_move_async(devices[stepper], tail_steps[stepper], NULL);
+    }
+    if(sequential) while(psc.devices[devices[stepper]].is_running);
+  }
+  if(!sequential){
+    // Wait for all motors to finish moving before proceeding
+    for(int stepper = 0; stepper < num_steppers; stepper++){
+      while(psc.devices[devices[stepper]].is_running);
+    }
+  }
+
+  // Make up for the steps lost while moving
+  for(int stepper = 0; stepper < num_steppers; stepper++){
+    picostepper_apply_correction(devices[stepper], NULL);
+  }
+  for(int stepper = 0; stepper < num_steppers; stepper++){
+    while(psc.devices[devices[stepper]].is_running);
+  }
+
+  // Movements at given speeds leave the speed settings of the steppers untouched
+  if(speeds != NULL){
+    for(uint stepper = 0; stepper < num_steppers; stepper++){
+      picostepper_set_async_delay(devices[stepper], previous_delays[stepper]);
+    }
+  }
+
   return true;
-}
\ No newline at end of file
+}
+
+// Stream one segment of a coordinated movement: every device steps to its position at its speed, without ramping
+// Waits until the previous segment has been handed to the PIOs and returns while this one is running,
+// so the next segment can be prepared in the meantime. The PIO FIFOs bridge the time between segments.
+bool picostepper_stream_segment(volatile PicoStepper devices[], int positions[], uint speeds[], uint num_steppers){
+
+  // A new velocity profile starts if the previous segment has already finished
+  // Its last commands may still be stepped from the TX FIFO after the DMA has handed them over
+  bool is_starting = true;
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    // Error: No valid PicoStepper device
+    if(devices[stepper] == -1) return false;
+    PicoStepper device = devices[stepper];
+    if(psc.devices[device].is_running || !pio_sm_is_tx_fifo_empty(psc.devices[device].pio, psc.devices[device].statemachine)) is_starting = false;
+  }
+
+  // Wait for the previous segment to be transferred
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    while(psc.devices[devices[stepper]].is_running);
+  }
+
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    PicoStepper device = devices[stepper];
+    int steps = positions[stepper] - psc.devices[device].position;
+    if(steps == 0) continue;
+
+    // Update the direction and the tracked position value
+    // The input shaper may keep stepping in the old direction after a reversal, later segments make up for it
+    if(is_starting) picostepper_shaper_reset(device);
+    picostepper_set_async_direction(device, steps > 0);
+    picostepper_set_profile_delay(device, picostepper_convert_speed_to_delay(max(speeds[stepper], 1)));
+    psc.devices[device].position += picostepper_command_direction(psc.devices[device].command, psc.devices[device].polarity) * abs(steps);
+    picostepper_move_async(device, abs(steps), NULL);
+  }
+
+  return true;
+}
+
+// Wait for all devices of a streamed movement to finish, then make up for the steps lost while moving
+void picostepper_stream_wait(volatile PicoStepper devices[], uint num_steppers){
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    while(psc.devices[devices[stepper]].is_running);
+  }
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    picostepper_apply_correction(devices[stepper], NULL);
+  }
+  for(uint stepper = 0; stepper < num_steppers; stepper++){
+    while(psc.devices[devices[stepper]].is_running);
+  }
+}
+
+#if PICOSTEPPER_TRACE
+// Start recording the commands handed to the PIOs into the preallocated trace buffer, dropping the previous trace
+void picostepper_trace_start(){
+  picostepper_psc_init();
+  uint32_t interrupts = save_and_disable_interrupts();
+  psc.trace_count = 0;
+  psc.trace_is_full = false;
+  psc.trace_is_running = true;
+  restore_interrupts(interrupts);
+}
+
+// Stop recording, returns false if the trace buffer was too small for the whole trace
+bool picostepper_trace_stop(){
+  psc.trace_is_running = false;
+  return !psc.trace_is_full;
+}
+
+// Write the recorded trace to stdout
+void picostepper_trace_export(PicoStepperTraceFormat format){
+  picostepper_trace_write(stdout, psc.trace, psc.trace_count, PICOSTEPPER_CYCLE_NS, format);
+}
+#endif
@@ -13,9 +13,16 @@
 #define MINDELAY 0
 #define NUMSTEPS 50 // The number of steps taken between accelerations
 #define MINSTEPS 15 // This number depends on you accelerations and speeds, and will need to be tuned to your setup
-#define A4988 false
-#define TMC2208 true
-#define DRIVER A4988
+#define MINSPEED 500 // Default speed (steps/second) a stepper starts, stops and reverses at
+#define SHAPER_HISTORY 32 // Number of velocity changes remembered by the input shaper, must cover the duration of the shaper
+#define SHAPER_MAX_IMPULSES 3
+#define SHAPER_COST_RUNS 1000 // Number of parts shaped by picostepper_measure_shaper_cost
+#define SHAPER_SLICE_FRACTION 4 // Shaped slices are split into parts lasting at most this fraction of the spacing of the impulses
+#define ENCODER_POLL_MS 1 // Interval at which the following error of steppers with an encoder is checked
+#ifndef PICOSTEPPER_TRACE
+#define PICOSTEPPER_TRACE 0 // Record the commands handed to the PIOs, see trace.h
+#endif
+#define TRACE_SIZE 1024 // Number of commands a trace can hold
 #define max(a,b) \
   ({ __typeof__ (a) _a = (a); \
       __typeof__ (b) _b = (b); \
@@ -37,14 +44,65 @@
 
 #include "four_wire.pio.h"
 #include "two_wire.pio.h"
+#include "quadrature_encoder.pio.h"
+#include "drivers.h"
+#include "trace.h"
 #include "stack.h"
 
+// The different types of drivers used to select the correct PIO-program, see PICOSTEPPER_DRIVERS
+#define PICOSTEPPER_DRIVER_TYPE(type, program, reversed_program, pins, polarity, pulse_width, dir_setup) type,
+enum PicoStepperMotorType_def {
+  PICOSTEPPER_DRIVERS(PICOSTEPPER_DRIVER_TYPE)
+  PicoStepperDriverCount
+};
+typedef enum PicoStepperMotorType_def PicoStepperMotorType;
+#undef PICOSTEPPER_DRIVER_TYPE
+
+// Program, pins and timing of a driver
+struct picostepper_driver_def {
+  const pio_program_t *program;
+  const pio_program_t *reversed_program;
+  pio_sm_config (*get_default_config)(uint offset);
+  pio_sm_config (*get_reversed_default_config)(uint offset);
+  uint pin_count;
+  bool polarity;
+  uint min_delay;
+};
+typedef struct picostepper_driver_def PicoStepperDriver;
+
 // The index of a device withing the PicoStepperContainer
 typedef int PicoStepper;
 
 // A function to call after a async movement has finished
 typedef void (*PicoStepperCallback)(PicoStepper);
 
+// The input shapers that can be applied to the velocity profile
+enum PicoStepperShaperType_def {
+  NoShaper,
+  ZVShaper,
+  ZVDShaper,
+  EIShaper
+};
+typedef enum PicoStepperShaperType_def PicoStepperShaperType;
+
+// Configuration and velocity history of an input shaper
+struct picostepper_shaper_def {
+  PicoStepperShaperType type;
+  uint impulses;
+  uint32_t amplitudes[SHAPER_MAX_IMPULSES]; // Q16 fixed point, summing up to 1
+  uint32_t times[SHAPER_MAX_IMPULSES]; // us
+  uint32_t time; // Profile time of the current slice in us, advanced by the duration of the streamed steps
+  uint speed; // Shaped speed of the current slice, 0 if its command is not shaped
+  bool is_settled; // The current slice runs at the commanded velocity
+  uint remaining_steps; // Steps of a split slice that still have to be streamed
+  PicoStepperCallback callback; // Invoked once all parts of a split slice have been streamed
+  uint32_t history_time[SHAPER_HISTORY];
+  int history_velocity[SHAPER_HISTORY]; // Signed, so reversals pass through zero
+  uint history_head;
+  uint history_count;
+};
+typedef struct picostepper_shaper_def PicoStepperShaper;
+
 // State and executing hardware of a StepperDevice
 struct picostepper_raw_device_def {
   bool is_configured;
@@ -56,11 +114,36 @@ struct picostepper_raw_device_def {
   int acceleration_direction;
   uint acceleration;
   uint moving_acceleration;
+  uint moving_max_speed;
   uint max_speed;
   uint min_speed;
   int coasting_slices;
   struct node *stack;
+  bool velocity_mode;
+  volatile int target_velocity;
+  int velocity;
+  PicoStepperCallback velocity_callback;
+  int step_position;
+  int slice_direction;
+  uint slice_steps;
+  int queued_direction;
+  uint queued_steps; // Steps of previous slices still waiting in the TX FIFO
+  bool encoder_is_configured;
+  PIO encoder_pio;
+  uint encoder_statemachine;
+  int encoder_counts;
+  int encoder_steps;
+  int encoder_offset;
+  int encoder_origin;
+  int pending_correction;
+  uint stall_threshold;
+  bool is_stalled;
+  PicoStepperCallback stall_callback;
+  PicoStepperShaper shaper;
   uint delay;
+  PicoStepperMotorType driver;
+  bool polarity;
+  uint min_delay;
 	PIO pio;
   int pio_id;
 	uint statemachine;
@@ -78,24 +161,58 @@ struct PicoStepperContainer
   PicoStepperRawDevice devices[8];
   bool device_with_index_is_in_use[8];
   int map_dma_ch_to_device_index[32];
+  const pio_program_t *programs[2][4];
+  uint program_offsets[2][4];
+  uint program_count[2];
+  bool encoder_program_is_loaded[2];
+#if PICOSTEPPER_TRACE
+  PicoStepperTraceRecord trace[TRACE_SIZE];
+  uint trace_count;
+  volatile bool trace_is_running;
+  bool trace_is_full;
+#endif
+  bool encoder_timer_is_running;
+  repeating_timer_t encoder_timer;
 };
 
-// The different types of steppers used to select the correct PIO-program
-enum PicoStepperMotorType_def {
-  FourWireDriver, 
-  FourWireDirect, 
-  TwoWireDriver
-};
-typedef enum PicoStepperMotorType_def PicoStepperMotorType;
-
 
 extern struct PicoStepperContainer psc;
+extern const PicoStepperDriver picostepper_drivers[PicoStepperDriverCount];
+
+// Encode a step command for the driver programs: | delay (30 bit) | direction | enabled |
+static inline uint32_t picostepper_encode_command(uint delay, bool direction, bool enabled) {
+  return (((delay << 1) | direction) << 1) | enabled;
+}
+
+// Get the direction a command steps a device in: 1 forward, -1 backward
+static inline int picostepper_command_direction(uint32_t command, bool polarity) {
+  return (((command >> 1) & 1) ^ polarity) ? 1 : -1;
+}
 extern bool psc_is_initialised;
 
 static void picostepper_async_handler();
 static PicoStepperRawDevice picostepper_create_raw_device();
 static void picostepper_psc_init();
-static PicoStepper picostepper_init_unclaimed_device();
+static bool picostepper_program_fits(int pio_id, const pio_program_t *program);
+static PicoStepper picostepper_init_unclaimed_device(const pio_program_t *program);
+static uint picostepper_load_program(int pio_id, const pio_program_t *program);
+static void picostepper_driver_init(PicoStepper device, PicoStepperMotorType driver, bool reversed, uint base_pin);
+static inline void picostepper_trace_record(PicoStepper device, uint steps, uint32_t command);
+static void picostepper_set_command(PicoStepper device, uint32_t command);
+static void picostepper_track_slice(PicoStepper device, uint steps, int direction);
+static uint picostepper_velocity_ramp(uint speed, uint goal, uint acceleration);
+static void picostepper_velocity_update(PicoStepper device);
+static int picostepper_encoder_read(PicoStepper device);
+static bool picostepper_encoder_monitor(repeating_timer_t *rt);
+static bool picostepper_apply_correction(PicoStepper device, PicoStepperCallback func);
+static void picostepper_shaper_reset(PicoStepper device);
+static int picostepper_shaper_apply(PicoStepperShaper *shaper, int velocity);
+static bool picostepper_shaper_is_settled(PicoStepperShaper *shaper);
+static uint picostepper_shaper_slice_steps(PicoStepper device, uint steps);
+static uint picostepper_shaper_tail_steps(uint speed, uint acceleration, uint duration);
+static void picostepper_shaper_continue(PicoStepper device);
+static bool picostepper_move_slice(PicoStepper device, int steps, PicoStepperCallback func);
+static void picostepper_set_profile_delay(PicoStepper device, uint delay);
 
 PicoStepper picostepper_init(uint base_pin, PicoStepperMotorType driver);
 PicoStepper picostepper_pindef_init(uint dir_pin, uint step_pin, PicoStepperMotorType driver);
@@ -113,7 +230,28 @@ void picostepper_accelerate(PicoStepper device);
 void picostepper_set_acceleration(PicoStepper device, uint acceleration);
 void picostepper_set_position(PicoStepper device, uint position);
 bool picostepper_move_to_positions(volatile PicoStepper devices[], int positions[], uint num_steppers, bool sequential);
+bool picostepper_move_to_positions_at(volatile PicoStepper devices[], int positions[], uint speeds[], uint num_steppers, bool sequential);
 void picostepper_set_max_speed(PicoStepper device, uint speed);
 void picostepper_set_min_speed(PicoStepper device, uint speed);
+bool picostepper_set_velocity(PicoStepper device, int velocity, PicoStepperCallback func);
+int picostepper_get_velocity(PicoStepper device);
+bool picostepper_encoder_init(PicoStepper device, uint base_pin, int counts, int steps);
+int picostepper_get_encoder_count(PicoStepper device);
+int picostepper_get_encoder_position(PicoStepper device);
+int picostepper_get_step_position(PicoStepper device);
+int picostepper_get_following_error(PicoStepper device);
+void picostepper_set_stall_threshold(PicoStepper device, uint threshold, PicoStepperCallback func);
+bool picostepper_is_stalled(PicoStepper device);
+bool picostepper_correct_following_error(PicoStepper device);
+bool picostepper_set_input_shaper(PicoStepper device, PicoStepperShaperType type, float frequency, float damping);
+uint picostepper_get_shaper_duration(PicoStepper device);
+uint picostepper_measure_shaper_cost(PicoStepper device);
+bool picostepper_stream_segment(volatile PicoStepper devices[], int positions[], uint speeds[], uint num_steppers);
+void picostepper_stream_wait(volatile PicoStepper devices[], uint num_steppers);
+#if PICOSTEPPER_TRACE
+void picostepper_trace_start();
+bool picostepper_trace_stop();
+void picostepper_trace_export(PicoStepperTraceFormat format);
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,304 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+
+#include "trace.h"
+
+// Find the next change of the command of a device from index on
+// Returns count once the next movement of the device starts or no records are left
+static unsigned int picostepper_trace_next_change(const PicoStepperTraceRecord records[], unsigned int count, unsigned int device, unsigned int index) {
+  for (; index < count; index++)
+  {
+    if(records[index].device != device) {
+      continue;
+    }
+    return records[index].steps == 0 ? index : count;
+  }
+  return count;
+}
+
+// Find the next movement of a device from index on, count if there is none
+static unsigned int picostepper_trace_next_movement(const PicoStepperTraceRecord records[], unsigned int count, unsigned int device, unsigned int index) {
+  for (; index < count; index++)
+  {
+    if(records[index].device == device && records[index].steps > 0) {
+      return index;
+    }
+  }
+  return count;
+}
+
+// Continue the expansion with the movement started by the record slice
+static void picostepper_trace_start_movement(PicoStepperTraceExpansion *expansion, unsigned int slice) {
+  expansion->slice = slice;
+  expansion->step = 0;
+  if(slice == expansion->count) {
+    return;
+  }
+  expansion->armed = (uint64_t) expansion->records[slice].time * 1000;
+  expansion->command = expansion->records[slice].command;
+  expansion->change = picostepper_trace_next_change(expansion->records, expansion->count, expansion->device, slice + 1);
+  // The PIO starts on the movement once it has finished the steps queued before
+  if(expansion->armed > expansion->start) {
+    expansion->start = expansion->armed;
+  }
+}
+
+// Start reconstructing the DIR and PUL edges of a device from the records
+void picostepper_trace_expansion_init(PicoStepperTraceExpansion *expansion, const PicoStepperTraceRecord records[], unsigned int count, unsigned int device, unsigned int cycle_ns) {
+  expansion->records = records;
+  expansion->count = count;
+  expansion->device = device;
+  expansion->cycle_ns = cycle_ns;
+  expansion->start = 0;
+  expansion->direction = -1;
+  expansion->position = 0;
+  expansion->steps_taken = 0;
+  expansion->edge_index = 0;
+  expansion->edge_count = 0;
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    expansion->edges[i].device = device;
+  }
+  picostepper_trace_start_movement(expansion, picostepper_trace_next_movement(records, count, device, 0));
+}
+
+// Reconstruct the edges of the next step, returns false once all movements have been expanded
+// The driver programs take delay + 10 cycles per step: PUL falls (and DIR is set) 6 cycles after the command is
+// pulled and rises delay + 2 cycles later. A changed command applies to steps not yet queued in the FIFO.
+static bool picostepper_trace_expand_step(PicoStepperTraceExpansion *expansion) {
+  const PicoStepperTraceRecord *records = expansion->records;
+  unsigned int count = expansion->count;
+  while (expansion->slice < count && expansion->step == records[expansion->slice].steps)
+  {
+    picostepper_trace_start_movement(expansion, picostepper_trace_next_movement(records, count, expansion->device, expansion->slice + 1));
+  }
+  if(expansion->slice == count) {
+    return false;
+  }
+
+  uint32_t step = expansion->step++;
+  uint64_t cycle_ns = expansion->cycle_ns;
+  // The DMA transfers a command once the command TRACE_FIFO_DEPTH steps ahead has been pulled
+  uint64_t transferred = step < TRACE_FIFO_DEPTH ? expansion->armed : expansion->history[step % TRACE_FIFO_DEPTH];
+  while (expansion->change < count && (uint64_t) records[expansion->change].time * 1000 <= transferred)
+  {
+    expansion->command = records[expansion->change].command;
+    expansion->change = picostepper_trace_next_change(records, count, expansion->device, expansion->change + 1);
+  }
+  expansion->history[step % TRACE_FIFO_DEPTH] = expansion->start;
+
+  // Disabled commands only take the cycles to pull and decode them
+  uint32_t command = expansion->command;
+  if((command & 1) == 0) {
+    expansion->start += 3 * cycle_ns;
+    return true;
+  }
+  int step_direction = ((command >> 1) & 1) ^ records[expansion->slice].polarity;
+  uint64_t delay = command >> 2;
+
+  PicoStepperTraceEdge *edge = &expansion->edges[0];
+  if(step_direction != expansion->direction) {
+    expansion->direction = step_direction;
+    edge->time = expansion->start + 6 * cycle_ns;
+    edge->signal = TraceDirection;
+    edge->value = step_direction;
+    edge->position = expansion->position;
+    edge++;
+  }
+  edge->time = expansion->start + 6 * cycle_ns;
+  edge->signal = TraceStep;
+  edge->value = 0;
+  edge->position = expansion->position;
+  edge++;
+
+  expansion->position += step_direction ? 1 : -1;
+  expansion->steps_taken++;
+  edge->time = expansion->start + (delay + 8) * cycle_ns;
+  edge->signal = TraceStep;
+  edge->value = 1;
+  edge->position = expansion->position;
+  edge++;
+
+  expansion->edge_count = edge - expansion->edges;
+  expansion->start += (delay + 10) * cycle_ns;
+  return true;
+}
+
+// Get the next edge of a device without consuming it, NULL once all edges have been reconstructed
+const PicoStepperTraceEdge *picostepper_trace_expansion_peek(PicoStepperTraceExpansion *expansion) {
+  while (expansion->edge_index == expansion->edge_count)
+  {
+    expansion->edge_index = 0;
+    expansion->edge_count = 0;
+    if(!picostepper_trace_expand_step(expansion)) {
+      return NULL;
+    }
+  }
+  return &expansion->edges[expansion->edge_index];
+}
+
+// Get the next edge of a device in time order, NULL once all edges have been reconstructed
+// The edge is valid until the expansion is continued
+const PicoStepperTraceEdge *picostepper_trace_expansion_next(PicoStepperTraceExpansion *expansion) {
+  const PicoStepperTraceEdge *edge = picostepper_trace_expansion_peek(expansion);
+  if(edge != NULL) {
+    expansion->edge_index++;
+  }
+  return edge;
+}
+
+// Reconstruct the DIR and PUL edges of a device from the records and call func for each of them in time order
+// Returns the number of steps taken
+unsigned int picostepper_trace_expand(const PicoStepperTraceRecord records[], unsigned int count, unsigned int device, unsigned int cycle_ns, PicoStepperTraceEdgeCallback func, void *context) {
+  PicoStepperTraceExpansion expansion;
+  picostepper_trace_expansion_init(&expansion, records, count, device, cycle_ns);
+  const PicoStepperTraceEdge *edge;
+  while ((edge = picostepper_trace_expansion_next(&expansion)) != NULL)
+  {
+    (*func)(edge, context);
+  }
+  return expansion.steps_taken;
+}
+
+// Get the next edge of all devices in time order, merging their expansions, NULL once all edges have been written
+// At the same time the edges of lower devices come first, DIR changes before PUL within a device
+static const PicoStepperTraceEdge *picostepper_trace_next_edge(PicoStepperTraceExpansion expansions[]) {
+  PicoStepperTraceExpansion *next = NULL;
+  uint64_t time = 0;
+  for (unsigned int device = 0; device < TRACE_MAX_DEVICES; device++)
+  {
+    const PicoStepperTraceEdge *edge = picostepper_trace_expansion_peek(&expansions[device]);
+    if(edge != NULL && (next == NULL || edge->time < time)) {
+      next = &expansions[device];
+      time = edge->time;
+    }
+  }
+  return next == NULL ? NULL : picostepper_trace_expansion_next(next);
+}
+
+static void picostepper_trace_write_records(FILE *file, const PicoStepperTraceRecord records[], unsigned int count) {
+  fprintf(file, "time_us,device,polarity,steps,command\n");
+  for (unsigned int i = 0; i < count; i++)
+  {
+    fprintf(file, "%llu,%u,%u,%lu,%lu\n", (unsigned long long) records[i].time, records[i].device, records[i].polarity, (unsigned long) records[i].steps, (unsigned long) records[i].command);
+  }
+}
+
+static void picostepper_trace_write_csv(FILE *file, PicoStepperTraceExpansion expansions[]) {
+  fprintf(file, "time_ns,device,signal,value,position\n");
+  const PicoStepperTraceEdge *edge;
+  while ((edge = picostepper_trace_next_edge(expansions)) != NULL)
+  {
+    fprintf(file, "%llu,%u,%s,%u,%ld\n", (unsigned long long) edge->time, edge->device, edge->signal == TraceStep ? "step" : "dir", edge->value, (long) edge->position);
+  }
+}
+
+static void picostepper_trace_write_vcd(FILE *file, const PicoStepperTraceRecord records[], unsigned int count, PicoStepperTraceExpansion expansions[]) {
+  bool is_used[TRACE_MAX_DEVICES] = {false};
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if(records[i].device < TRACE_MAX_DEVICES) is_used[records[i].device] = true;
+  }
+
+  // Each device gets two identifiers: '!' + 2 * device for PUL and the one after it for DIR
+  fprintf(file, "$timescale 1ns $end\n$scope module picostepper $end\n");
+  for (unsigned int device = 0; device < TRACE_MAX_DEVICES; device++)
+  {
+    if(!is_used[device]) continue;
+    fprintf(file, "$var wire 1 %c step%u $end\n", '!' + 2 * device, device);
+    fprintf(file, "$var wire 1 %c dir%u $end\n", '!' + 2 * device + 1, device);
+  }
+  fprintf(file, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+  for (unsigned int device = 0; device < TRACE_MAX_DEVICES; device++)
+  {
+    if(!is_used[device]) continue;
+    fprintf(file, "x%c\nx%c\n", '!' + 2 * device, '!' + 2 * device + 1);
+  }
+  fprintf(file, "$end\n");
+
+  const PicoStepperTraceEdge *edge;
+  bool is_first = true;
+  uint64_t time = 0;
+  while ((edge = picostepper_trace_next_edge(expansions)) != NULL)
+  {
+    if(is_first || edge->time != time) {
+      fprintf(file, "#%llu\n", (unsigned long long) edge->time);
+    }
+    is_first = false;
+    time = edge->time;
+    fprintf(file, "%u%c\n", edge->value, '!' + 2 * edge->device + (edge->signal == TraceDirection));
+  }
+}
+
+// Write the records of a trace, or the edges reconstructed from them, to a file
+// The edges of all devices are reconstructed and merged while writing, without holding them in memory
+void picostepper_trace_write(FILE *file, const PicoStepperTraceRecord records[], unsigned int count, unsigned int cycle_ns, PicoStepperTraceFormat format) {
+  if(format == TraceRecords) {
+    picostepper_trace_write_records(file, records, count);
+    return;
+  }
+
+  // Kept off the stack, which is small on the target
+  static PicoStepperTraceExpansion expansions[TRACE_MAX_DEVICES];
+  for (unsigned int device = 0; device < TRACE_MAX_DEVICES; device++)
+  {
+    picostepper_trace_expansion_init(&expansions[device], records, count, device, cycle_ns);
+  }
+  if(format == TraceCSV) {
+    picostepper_trace_write_csv(file, expansions);
+  } else {
+    picostepper_trace_write_vcd(file, records, count, expansions);
+  }
+}
+
+// Read records written in the TraceRecords format. The returned array has to be freed by the caller, on failure none is returned.
+bool picostepper_trace_read(FILE *file, PicoStepperTraceRecord **records, unsigned int *count) {
+  unsigned int capacity = 256;
+  *records = malloc(capacity * sizeof(PicoStepperTraceRecord));
+  *count = 0;
+  if(*records == NULL) {
+    return false;
+  }
+
+  char line[128];
+  unsigned long long previous_time = 0;
+  uint64_t wraps = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    unsigned long long time;
+    unsigned long steps, command;
+    unsigned int device, polarity;
+    // Skip the header and any other output mixed into the trace
+    if(sscanf(line, "%llu,%u,%u,%lu,%lu", &time, &device, &polarity, &steps, &command) != 5) {
+      continue;
+    }
+    if(*count == capacity) {
+      capacity *= 2;
+      PicoStepperTraceRecord *grown = realloc(*records, capacity * sizeof(PicoStepperTraceRecord));
+      // Error: Out of memory
+      if(grown == NULL) {
+        free(*records);
+        *records = NULL;
+        *count = 0;
+        return false;
+      }
+      *records = grown;
+    }
+    // Traces recorded with 32 bit timestamps wrap around every 71 minutes
+    if(*count > 0 && time < previous_time && previous_time <= UINT32_MAX) {
+      wraps++;
+    }
+    previous_time = time;
+    PicoStepperTraceRecord *record = &(*records)[(*count)++];
+    record->time = time + (wraps << 32);
+    record->device = device;
+    record->polarity = polarity;
+    record->steps = steps;
+    record->command = command;
+  }
+  return true;
+}
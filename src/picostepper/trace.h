@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+
+#ifndef PICOSTEPPER_TRACE_H
+#define PICOSTEPPER_TRACE_H
+
+#define TRACE_FIFO_DEPTH 9 // Commands queued ahead of the running step: the joined TX FIFO and the OSR
+#define TRACE_MAX_DEVICES 8
+
+// The trace is independent of the Pico SDK, so it can be used on the target and in host tools
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// A command handed to the PIO of a device
+// steps > 0: a movement of steps steps was started with command
+// steps == 0: the command of a running movement was changed
+struct picostepper_trace_record_def {
+  uint64_t time; // us
+  uint8_t device;
+  uint8_t polarity;
+  uint32_t steps;
+  uint32_t command;
+};
+typedef struct picostepper_trace_record_def PicoStepperTraceRecord;
+
+// The signals of a device
+enum PicoStepperTraceSignal_def {
+  TraceStep,
+  TraceDirection
+};
+typedef enum PicoStepperTraceSignal_def PicoStepperTraceSignal;
+
+// A change of a signal reconstructed from the records
+struct picostepper_trace_edge_def {
+  uint64_t time; // ns
+  uint8_t device;
+  uint8_t signal;
+  uint8_t value;
+  int32_t position; // Position after the edge
+};
+typedef struct picostepper_trace_edge_def PicoStepperTraceEdge;
+
+// The formats a trace can be written in
+enum PicoStepperTraceFormat_def {
+  TraceRecords, // The records themselves, to be analyzed on a host
+  TraceCSV,     // One line per edge
+  TraceVCD      // Value change dump, for waveform viewers
+};
+typedef enum PicoStepperTraceFormat_def PicoStepperTraceFormat;
+
+// A function called for every reconstructed edge
+typedef void (*PicoStepperTraceEdgeCallback)(const PicoStepperTraceEdge *edge, void *context);
+
+// State of the reconstruction of the edges of a device, one step at a time
+struct picostepper_trace_expansion_def {
+  const PicoStepperTraceRecord *records;
+  unsigned int count;
+  unsigned int device;
+  unsigned int cycle_ns;
+  unsigned int slice; // Record of the running movement, count once all have been expanded
+  unsigned int change; // Next change of the command of the running movement
+  uint32_t step;
+  uint32_t command;
+  uint64_t armed; // ns
+  uint64_t start; // ns, the PIO pulls the command of the next step
+  uint64_t history[TRACE_FIFO_DEPTH];
+  int direction;
+  int32_t position;
+  unsigned int steps_taken;
+  PicoStepperTraceEdge edges[3]; // Edges of the current step that are yet to be returned
+  unsigned int edge_index;
+  unsigned int edge_count;
+};
+typedef struct picostepper_trace_expansion_def PicoStepperTraceExpansion;
+
+void picostepper_trace_expansion_init(PicoStepperTraceExpansion *expansion, const PicoStepperTraceRecord records[], unsigned int count, unsigned int device, unsigned int cycle_ns);
+const PicoStepperTraceEdge *picostepper_trace_expansion_peek(PicoStepperTraceExpansion *expansion);
+const PicoStepperTraceEdge *picostepper_trace_expansion_next(PicoStepperTraceExpansion *expansion);
+unsigned int picostepper_trace_expand(const PicoStepperTraceRecord records[], unsigned int count, unsigned int device, unsigned int cycle_ns, PicoStepperTraceEdgeCallback func, void *context);
+void picostepper_trace_write(FILE *file, const PicoStepperTraceRecord records[], unsigned int count, unsigned int cycle_ns, PicoStepperTraceFormat format);
+bool picostepper_trace_read(FILE *file, PicoStepperTraceRecord **records, unsigned int *count);
+
+#endif
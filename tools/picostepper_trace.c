@@ -0,0 +1,331 @@
+/**
+ * Copyright (c) 2021 Bjarne Dasenbrook
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+// Offline analysis of traces recorded with picostepper_trace_start/picostepper_trace_export(TraceRecords)
+// Build on the host: cc -O2 -I src/picostepper -o picostepper_trace tools/picostepper_trace.c src/picostepper/trace.c -lm
+
+#include <string.h>
+#include <math.h>
+#include "trace.h"
+
+// The step times and positions of a device
+struct trace_axis {
+  double *times; // s
+  int *positions;
+  unsigned int count;
+};
+
+// A movement of a device: consecutive steps without a pause
+struct trace_move {
+  unsigned int device;
+  unsigned int first;
+  unsigned int last;
+};
+
+struct trace_options {
+  unsigned int clkdiv;
+  double gap; // s
+  unsigned int window; // steps
+  double acceleration;
+  double max_speed;
+  double min_speed;
+  const char *vcd;
+  const char *csv;
+  const char *profile;
+};
+
+static double move_start(const struct trace_axis axes[], const struct trace_move *move) {
+  return axes[move->device].times[move->first];
+}
+
+static const struct trace_axis *sort_axes;
+
+static int compare_moves(const void *a, const void *b) {
+  double start_a = move_start(sort_axes, a);
+  double start_b = move_start(sort_axes, b);
+  if(start_a != start_b) return start_a < start_b ? -1 : 1;
+  return (int) ((const struct trace_move *) a)->device - (int) ((const struct trace_move *) b)->device;
+}
+
+static void usage() {
+  fprintf(stderr,
+    "Usage: picostepper_trace [options] trace.csv\n"
+    "  --clkdiv N        CLKDIV the firmware was built with (default 125)\n"
+    "  --gap MS          pause that separates two movements (default 50)\n"
+    "  --window N        steps per velocity sample (default 50, the NUMSTEPS between speed changes)\n"
+    "  --accel A         commanded acceleration (steps/s^2) to compare against\n"
+    "  --max-speed V     commanded maximum speed (steps/s)\n"
+    "  --min-speed V     commanded start/stop speed (steps/s)\n"
+    "  --vcd FILE        write the step/dir edges as value change dump\n"
+    "  --csv FILE        write the step/dir edges as CSV\n"
+    "  --profile FILE    write position, velocity, acceleration and jerk per axis as CSV\n");
+}
+
+static void collect_step(const PicoStepperTraceEdge *edge, void *context) {
+  struct trace_axis *axis = context;
+  if(edge->signal != TraceStep || edge->value != 1) {
+    return;
+  }
+  axis->times[axis->count] = (double) edge->time * 1e-9;
+  axis->positions[axis->count] = edge->position;
+  axis->count++;
+}
+
+// Time at which the commanded trapezoidal profile over distance steps reaches position steps
+static double profile_time(const struct trace_options *options, double distance, double position) {
+  double v0 = options->min_speed;
+  double a = options->acceleration;
+  if(a <= 0) {
+    return position / options->max_speed;
+  }
+  // Peak speed: limited by the maximum speed or by meeting the deceleration half way
+  double peak = sqrt(v0 * v0 + a * distance);
+  if(options->max_speed > 0 && peak > options->max_speed) peak = options->max_speed;
+  if(peak < v0) peak = v0;
+  double ramp = (peak * peak - v0 * v0) / (2 * a);
+  double ramp_time = (peak - v0) / a;
+  double cruise = distance - 2 * ramp;
+
+  if(position <= ramp) {
+    return (sqrt(v0 * v0 + 2 * a * position) - v0) / a;
+  }
+  if(position <= ramp + cruise) {
+    return ramp_time + (position - ramp) / peak;
+  }
+  double decelerated = position - ramp - cruise;
+  double speed = sqrt(fmax(peak * peak - 2 * a * decelerated, 0));
+  return ramp_time + cruise / peak + (peak - speed) / a;
+}
+
+// Position of an axis at a time, by the last step taken before it
+static int position_at(const struct trace_axis *axis, unsigned int first, unsigned int last, double time) {
+  if(time < axis->times[first]) return first > 0 ? axis->positions[first - 1] : 0;
+  unsigned int low = first;
+  unsigned int high = last;
+  while (low < high)
+  {
+    unsigned int middle = (low + high + 1) / 2;
+    if(axis->times[middle] <= time) low = middle; else high = middle - 1;
+  }
+  return axis->positions[low];
+}
+
+// Velocity, acceleration and jerk of a movement sampled every window steps
+// Movements shorter than the window are sampled over their whole length, the last sample ends at the last step
+static void analyze_move(const struct trace_axis *axis, const struct trace_move *move, const struct trace_options *options, FILE *profile) {
+  unsigned int window = options->window < move->last - move->first ? options->window : move->last - move->first;
+  double peak_velocity = 0, peak_acceleration = 0, peak_jerk = 0;
+  double previous_velocity = 0, previous_acceleration = 0, previous_time = 0;
+  unsigned int samples = 0;
+
+  unsigned int i = move->first;
+  while (window > 0 && i < move->last)
+  {
+    i = i + window < move->last ? i + window : move->last;
+    double duration = axis->times[i] - axis->times[i - window];
+    if(duration <= 0) continue;
+    double time = (axis->times[i] + axis->times[i - window]) / 2;
+    double velocity = (axis->positions[i] - axis->positions[i - window]) / duration;
+    double acceleration = samples > 0 ? (velocity - previous_velocity) / (time - previous_time) : 0;
+    double jerk = samples > 1 ? (acceleration - previous_acceleration) / (time - previous_time) : 0;
+
+    peak_velocity = fmax(peak_velocity, fabs(velocity));
+    if(samples > 0) peak_acceleration = fmax(peak_acceleration, fabs(acceleration));
+    if(samples > 1) peak_jerk = fmax(peak_jerk, fabs(jerk));
+    if(profile != NULL) {
+      fprintf(profile, "%.9f,%u,%d,%.3f,%.3f,%.3f\n", time, move->device, axis->positions[i], velocity, acceleration, jerk);
+    }
+    previous_velocity = velocity;
+    previous_acceleration = acceleration;
+    previous_time = time;
+    samples++;
+  }
+
+  int start = move->first > 0 ? axis->positions[move->first - 1] : 0;
+  unsigned int distance = abs(axis->positions[move->last] - start);
+  double duration = axis->times[move->last] - axis->times[move->first];
+  printf("  device %u: %6u steps in %9.3f ms, peak velocity %9.1f steps/s, acceleration %11.1f steps/s^2, jerk %14.1f steps/s^3\n",
+    move->device, distance, duration * 1e3, peak_velocity, peak_acceleration, peak_jerk);
+
+  // Compare the time each step was taken with the commanded profile
+  if(options->max_speed > 0 || options->acceleration > 0) {
+    double deviation = 0;
+    for (unsigned int i = move->first; i <= move->last; i++)
+    {
+      double expected = profile_time(options, distance, i - move->first + 1);
+      deviation = fmax(deviation, fabs(axis->times[i] - axis->times[move->first] - expected + profile_time(options, distance, 1)));
+    }
+    double expected_duration = profile_time(options, distance, distance) - profile_time(options, distance, 1);
+    printf("            commanded profile: %9.3f ms, deviation up to %9.3f ms\n", expected_duration * 1e3, deviation * 1e3);
+  }
+}
+
+// Compare the progress of two movements running at the same time
+static void analyze_sync(const struct trace_axis axes[], const struct trace_move *a, const struct trace_move *b) {
+  const struct trace_axis *axis_a = &axes[a->device];
+  const struct trace_axis *axis_b = &axes[b->device];
+  int start_a = a->first > 0 ? axis_a->positions[a->first - 1] : 0;
+  int start_b = b->first > 0 ? axis_b->positions[b->first - 1] : 0;
+  double distance_a = axis_a->positions[a->last] - start_a;
+  double distance_b = axis_b->positions[b->last] - start_b;
+
+  double skew = axis_b->times[b->last] - axis_a->times[a->last];
+  // A movement of a that returns to its start has no proportion to follow
+  if(distance_a == 0) {
+    printf("  sync device %u/%u: end skew %9.3f ms, path deviation     n/a\n", a->device, b->device, skew * 1e3);
+    return;
+  }
+
+  // Deviation (in steps of b) from moving in proportion to a
+  double deviation = 0;
+  for (unsigned int i = a->first; i <= a->last; i++)
+  {
+    double expected = (axis_a->positions[i] - start_a) / distance_a * distance_b;
+    double actual = position_at(axis_b, b->first, b->last, axis_a->times[i]) - start_b;
+    deviation = fmax(deviation, fabs(actual - expected));
+  }
+  printf("  sync device %u/%u: end skew %9.3f ms, path deviation up to %7.1f steps\n", a->device, b->device, skew * 1e3, deviation);
+}
+
+int main(int argc, char **argv) {
+  struct trace_options options = {125, 0.05, 50, 0, 0, 0, NULL, NULL, NULL};
+  const char *input = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    bool has_value = i + 1 < argc;
+    if(strcmp(argv[i], "--clkdiv") == 0 && has_value) options.clkdiv = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--gap") == 0 && has_value) options.gap = atof(argv[++i]) * 1e-3;
+    else if(strcmp(argv[i], "--window") == 0 && has_value) options.window = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--accel") == 0 && has_value) options.acceleration = atof(argv[++i]);
+    else if(strcmp(argv[i], "--max-speed") == 0 && has_value) options.max_speed = atof(argv[++i]);
+    else if(strcmp(argv[i], "--min-speed") == 0 && has_value) options.min_speed = atof(argv[++i]);
+    else if(strcmp(argv[i], "--vcd") == 0 && has_value) options.vcd = argv[++i];
+    else if(strcmp(argv[i], "--csv") == 0 && has_value) options.csv = argv[++i];
+    else if(strcmp(argv[i], "--profile") == 0 && has_value) options.profile = argv[++i];
+    else if(argv[i][0] != '-' && input == NULL) input = argv[i];
+    else {
+      usage();
+      return 1;
+    }
+  }
+  if(input == NULL || options.clkdiv == 0 || options.window == 0) {
+    usage();
+    return 1;
+  }
+
+  FILE *file = strcmp(input, "-") == 0 ? stdin : fopen(input, "r");
+  if(file == NULL) {
+    perror(input);
+    return 1;
+  }
+  PicoStepperTraceRecord *records;
+  unsigned int count;
+  if(!picostepper_trace_read(file, &records, &count)) {
+    fprintf(stderr, "%s: out of memory\n", input);
+    return 1;
+  }
+  if(file != stdin) fclose(file);
+
+  // PIO cycle at a system clock of 125MHz
+  unsigned int cycle_ns = 8 * options.clkdiv;
+
+  const char *outputs[2] = {options.vcd, options.csv};
+  PicoStepperTraceFormat formats[2] = {TraceVCD, TraceCSV};
+  for (int i = 0; i < 2; i++)
+  {
+    if(outputs[i] == NULL) continue;
+    FILE *output = fopen(outputs[i], "w");
+    if(output == NULL) {
+      perror(outputs[i]);
+      return 1;
+    }
+    picostepper_trace_write(output, records, count, cycle_ns, formats[i]);
+    fclose(output);
+  }
+
+  // Reconstruct the steps of every device
+  struct trace_axis axes[TRACE_MAX_DEVICES];
+  for (unsigned int device = 0; device < TRACE_MAX_DEVICES; device++)
+  {
+    unsigned int steps = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+      if(records[i].device == device) steps += records[i].steps;
+    }
+    axes[device].times = malloc((steps + 1) * sizeof(double));
+    axes[device].positions = malloc((steps + 1) * sizeof(int));
+    axes[device].count = 0;
+    if(axes[device].times == NULL || axes[device].positions == NULL) {
+      fprintf(stderr, "%s: out of memory\n", input);
+      return 1;
+    }
+    picostepper_trace_expand(records, count, device, cycle_ns, &collect_step, &axes[device]);
+  }
+
+  // Split the steps into movements at pauses
+  unsigned int move_capacity = 64;
+  unsigned int move_count = 0;
+  struct trace_move *moves = malloc(move_capacity * sizeof(struct trace_move));
+  if(moves == NULL) {
+    fprintf(stderr, "%s: out of memory\n", input);
+    return 1;
+  }
+  for (unsigned int device = 0; device < TRACE_MAX_DEVICES; device++)
+  {
+    struct trace_axis *axis = &axes[device];
+    for (unsigned int first = 0; first < axis->count;)
+    {
+      unsigned int last = first;
+      while (last + 1 < axis->count && axis->times[last + 1] - axis->times[last] <= options.gap) last++;
+      if(move_count == move_capacity) {
+        move_capacity *= 2;
+        struct trace_move *grown = realloc(moves, move_capacity * sizeof(struct trace_move));
+        if(grown == NULL) {
+          fprintf(stderr, "%s: out of memory\n", input);
+          return 1;
+        }
+        moves = grown;
+      }
+      moves[move_count++] = (struct trace_move) {device, first, last};
+      first = last + 1;
+    }
+  }
+
+  sort_axes = axes;
+  qsort(moves, move_count, sizeof(struct trace_move), &compare_moves);
+
+  FILE *profile = NULL;
+  if(options.profile != NULL) {
+    profile = fopen(options.profile, "w");
+    if(profile == NULL) {
+      perror(options.profile);
+      return 1;
+    }
+    fprintf(profile, "time_s,device,position,velocity,acceleration,jerk\n");
+  }
+
+  printf("%u records, %u movements\n", count, move_count);
+  for (unsigned int i = 0; i < move_count; i++)
+  {
+    const struct trace_axis *axis = &axes[moves[i].device];
+    printf("movement at %.3f ms:\n", move_start(axes, &moves[i]) * 1e3);
+    analyze_move(axis, &moves[i], &options, profile);
+
+    // Movements of other devices that start within the gap are considered coordinated
+    for (unsigned int j = i + 1; j < move_count; j++)
+    {
+      double start_difference = move_start(axes, &moves[j]) - move_start(axes, &moves[i]);
+      if(start_difference > options.gap) break;
+      if(moves[j].device != moves[i].device) {
+        analyze_sync(axes, &moves[i], &moves[j]);
+      }
+    }
+  }
+
+  if(profile != NULL) fclose(profile);
+  return 0;
+}